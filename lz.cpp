@@ -0,0 +1,200 @@
+/*
+ * Wadmerge: Merges WAD files used for Doom/Doom2/Hexen/Heretic
+ * Copyright (C) 2014  Dennis Katsonis dennisk@netspace.net.au
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <cstring>
+#include <algorithm>
+#include <stdint.h>
+#include "lz.h"
+
+
+const int lzMinMatch = 4; // Shorter matches cost more to encode than the literals.
+const int lzMaxOffset = 65535;
+const int lzHashBits = 12;
+const int lzLastLiterals = 5; // The end of the input is always literals, which keeps the matcher in bounds.
+
+static uint32_t read32 ( const unsigned char *p )
+{
+    uint32_t value;
+    std::memcpy ( &value, p, sizeof ( value ) );
+    return value;
+}
+
+static int hashOf ( uint32_t value )
+{
+    return ( value * 2654435761u ) >> ( 32 - lzHashBits );
+}
+
+static bool writeLength ( unsigned char *&out, const unsigned char *outend, int length )
+{
+    // The part of a length which didn't fit in the token, as a run of 255s and the remainder.
+    while ( length >= 255 ) {
+        if ( out == outend ) {
+            return false;
+        }
+        *out++ = 255;
+        length -= 255;
+    }
+    if ( out == outend ) {
+        return false;
+    }
+    *out++ = length;
+    return true;
+}
+
+static bool writeSequence ( unsigned char *&out, const unsigned char *outend, const unsigned char *literals, int numliterals, int offset, int matchlength )
+{
+    // A match length of zero means this is the last sequence, which has no match.
+    int matchcode = matchlength ? matchlength - lzMinMatch : 0;
+
+    if ( out == outend ) {
+        return false;
+    }
+    *out++ = ( std::min ( numliterals, 15 ) << 4 ) | std::min ( matchcode, 15 );
+    if ( ( numliterals >= 15 ) && !writeLength ( out, outend, numliterals - 15 ) ) {
+        return false;
+    }
+    if ( outend - out < numliterals ) {
+        return false;
+    }
+    if ( numliterals > 0 ) {
+        std::memcpy ( out, literals, numliterals );
+        out += numliterals;
+    }
+
+    if ( matchlength ) {
+        if ( outend - out < 2 ) {
+            return false;
+        }
+        *out++ = offset & 0xff;
+        *out++ = offset >> 8;
+        if ( ( matchcode >= 15 ) && !writeLength ( out, outend, matchcode - 15 ) ) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int lzCompress ( const char *source, int size, char *dest, int capacity )
+{
+    const unsigned char *src = reinterpret_cast<const unsigned char *> ( source );
+    unsigned char *out = reinterpret_cast<unsigned char *> ( dest );
+    const unsigned char *outend = out + capacity;
+    int table[1 << lzHashBits];
+    int anchor = 0; // Start of the literals not yet written.
+    int pos = 0;
+    int misses = 0; // Since the last match.
+    int matchlimit = size - lzLastLiterals;
+
+    std::fill ( table, table + ( 1 << lzHashBits ), -1 );
+
+    while ( pos + lzMinMatch <= matchlimit ) {
+        uint32_t value = read32 ( src + pos );
+        int h = hashOf ( value );
+        int candidate = table[h];
+
+        table[h] = pos;
+        if ( ( candidate < 0 ) || ( pos - candidate > lzMaxOffset ) || ( read32 ( src + candidate ) != value ) ) {
+            // Step further the longer we go without a match, so data which doesn't compress is passed quickly.
+            pos += 1 + ( misses++ >> 6 );
+            continue;
+        }
+
+        int length = lzMinMatch;
+        while ( ( pos + length < matchlimit ) && ( src[candidate + length] == src[pos + length] ) ) {
+            ++length;
+        }
+        if ( !writeSequence ( out, outend, src + anchor, pos - anchor, pos - candidate, length ) ) {
+            return 0;
+        }
+        pos += length;
+        anchor = pos;
+        misses = 0;
+    }
+
+    if ( !writeSequence ( out, outend, src + anchor, size - anchor, 0, 0 ) ) {
+        return 0;
+    }
+    return out - reinterpret_cast<unsigned char *> ( dest );
+}
+
+static bool readLength ( const unsigned char *&in, const unsigned char *inend, int &length )
+{
+    unsigned char byte;
+
+    do {
+        if ( in == inend ) {
+            return false;
+        }
+        byte = *in++;
+        length += byte;
+    } while ( byte == 255 );
+    return true;
+}
+
+bool lzDecompress ( const char *source, int packedsize, char *dest, int size )
+{
+    const unsigned char *in = reinterpret_cast<const unsigned char *> ( source );
+    const unsigned char *inend = in + packedsize;
+    unsigned char *out = reinterpret_cast<unsigned char *> ( dest );
+    unsigned char *outstart = out;
+    unsigned char *outend = out + size;
+
+    while ( in < inend ) {
+        unsigned char token = *in++;
+        int numliterals = token >> 4;
+
+        if ( ( numliterals == 15 ) && !readLength ( in, inend, numliterals ) ) {
+            return false;
+        }
+        if ( ( inend - in < numliterals ) || ( outend - out < numliterals ) ) {
+            return false;
+        }
+        if ( numliterals > 0 ) {
+            std::memcpy ( out, in, numliterals );
+            in += numliterals;
+            out += numliterals;
+        }
+
+        if ( in == inend ) {
+            break; // The last sequence has no match.
+        }
+        if ( inend - in < 2 ) {
+            return false;
+        }
+
+        int offset = in[0] | ( in[1] << 8 );
+        int length = token & 15;
+        in += 2;
+        if ( ( length == 15 ) && !readLength ( in, inend, length ) ) {
+            return false;
+        }
+        length += lzMinMatch;
+        if ( ( offset == 0 ) || ( offset > out - outstart ) || ( outend - out < length ) ) {
+            return false;
+        }
+
+        // The match can overlap what it is writing, so copy a byte at a time.
+        const unsigned char *match = out - offset;
+        for ( int x = 0; x < length; ++x ) {
+            out[x] = match[x];
+        }
+        out += length;
+    }
+    return out == outend;
+}
@@ -0,0 +1,39 @@
+/*
+ * Wadmerge: Merges WAD files used for Doom/Doom2/Hexen/Heretic
+ * Copyright (C) 2014  Dennis Katsonis dennisk@netspace.net.au
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef LZ_H
+#define LZ_H
+
+// A small, fast LZ77 compressor for keeping lump data compressed in memory.  The format is
+// a series of sequences, each a token byte (number of literals in the top four bits, match
+// length less four in the bottom four, with 15 meaning more length bytes follow), the literals,
+// and a two byte offset back to the match.  The last sequence is literals only.
+//
+// The output depends only on the input, so two lumps with the same data always compress
+// to the same bytes.
+
+// Compresses 'size' bytes from 'source' into 'dest'.  Returns the compressed size, or 0 if
+// it would be more than 'capacity' bytes.
+int lzCompress ( const char *source, int size, char *dest, int capacity );
+
+// Decompresses 'packedsize' bytes from 'source' into exactly 'size' bytes at 'dest'.
+// Returns false if the data is corrupt.
+bool lzDecompress ( const char *source, int packedsize, char *dest, int size );
+
+#endif // LZ_H
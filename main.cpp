@@ -21,9 +21,14 @@
 #include <iostream>
 #include <string>
 #include <cstring>
+#include <cstdlib>
+#include <cstdio>
 
 #ifdef __linux__
 #include <unistd.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
 
 #else
 #include "getopt.h"
@@ -31,8 +36,15 @@
 
 #include <fstream>
 #include "wad.h"
+#include "pipeline.h"
+#include "trace.h"
 #include "version.h"
 
+const size_t loaderLookahead = 2; // Number of wads which may be loaded ahead of the merge.
+const int watchSettleTime = 200; // Milliseconds without changes before merging again, when watching.
+
+std::string tracefile; // Where to write the timeline to, if asked for.
+
 
 void printLicense ( void )
 {
@@ -52,27 +64,277 @@ void print_help ( void )
 {
     std::cout << "By default, wadmerge will not include duplicate wad lumps.  The first entry\n"
               "encountered will be the one used in the output file.  If the input wads double\n"
-              "up on wad data, put the wad with the data to keep first.\n\n"
+              "up on wad data, put the wad with the data to keep first, or use -l to have the\n"
+              "last one win, as source ports do.\n\n"
               "By default, output wad will be a PWAD, unless at least one of the input wads is\n"
               "an IWAD.  Specify -I or -P to override this behaiviour.\n\n"
               "Usage : wadmerge [options] -i input1.wad -i input2.wad -i input3 -o output.wad\n\n"
               "Options :\n"
               " -d Allow duplicate lumps.\t\t-o Output filename.\n"
               " -I Output file is an IWAD.\t\t-P Output file is a PWAD.\n"
-              " -i Input Wad filename.\n"
+              " -i Input Wad filename.\t\t-l Later duplicate lumps replace earlier ones.\n"
+              " -i - Read an input wad from standard input.\n"
               " -c Compact (deduplicate).  Store multiple lumps with the same data\n"
               "    only once per wad.\n"
+              " -b Base wad.  Only write lumps which differ from those in this wad,\n"
+              "    giving a PWAD to be loaded on top of it.\n"
+              " -p Pipelined.  Load the next input while merging the current one, and\n"
+              "    write lump data out as it is merged.\n"
+              " -j Number of threads to merge with.\n"
+              " -w Watch the input wads, and merge again whenever one changes.\n"
+              " -T Write a timeline of the run to this file, in Chrome trace format.\n"
+              " -z Keep lump data compressed in memory, to merge more than fits.\n"
+              " -a Lay out lump data so the wad compresses better in an archive.\n"
+              " -x Extract.  Write each lump of the output to its own file in this\n"
+              "    directory, instead of writing a wad.  A directory written this way\n"
+              "    can be given to -i, to pack it back into a wad.\n"
               " -V Show license.\n";
 }
 
+void setOutputType ( Wad& output, Wad& input, unsigned int flags )
+{
+    // If any wads are IWADS and user hasn't selected an option, make the ouput IWAD. PWAD is default.
+    if ( ! ( flags & F_IWAD ) && ! ( flags & F_PWAD ) ) {
+        if ( input.wadType() == WAD_IWAD ) {
+            output.wadType ( WAD_IWAD );
+        }
+    }
+}
+
+
+int finishOutput ( Wad& output, Wad* base, unsigned int flags, const std::string& outputfile, const std::string& savefile, LumpWriter* writer )
+{
+    // Everything after the merge.  The wad is written to 'savefile', which may be a temporary
+    // name for 'outputfile'.
+    if ( flags & F_IWAD ) { // If the user has selected IWAD or PWAD, override.
+        output.wadType ( WAD_IWAD );
+    } else if ( flags & F_PWAD ) {
+        output.wadType ( WAD_PWAD );
+    }
+
+    if ( base ) {
+        std::cout << "Comparing against base wad" << std::endl;
+        output.deltaAgainst ( *base );
+        output.wadType ( WAD_PWAD );
+    }
+
+    if ( flags & F_EXTRACT ) {
+        std::cout << "Extracting to " << outputfile << "..." << std::endl;
+    } else {
+        std::cout << "Writing " << outputfile << "..." << std::endl;
+    }
+
+    if ( flags & F_DEDUP ) {
+        std::cout << "Deduplicating...\n";
+        output.deduplicate();
+    }
+    try {
+        if ( writer ) {
+            output.saveStreamed ();
+        } else if ( flags & F_EXTRACT ) {
+            output.extract ( savefile.c_str () );
+        } else {
+            output.save ( savefile.c_str () );
+        }
+    } catch ( std::string &err ) {
+        std::cout << err << " : " << savefile << std::endl;
+        return 1;
+    }
+    output.stats();
+    return 0;
+}
+
+bool namesInput ( const std::string& outputfile, const std::vector< std::string >& inputnames )
+{
+    // Whether the output is one of the inputs, perhaps under another name.
+#ifdef __linux__
+    struct stat out;
+    if ( stat ( outputfile.c_str(), &out ) != 0 ) {
+        return false; // It doesn't exist yet, so can't be.
+    }
+#endif
+    for ( std::vector< std::string >::const_iterator name = inputnames.begin(); name != inputnames.end(); ++name ) {
+        if ( *name == outputfile ) {
+            return true;
+        }
+#ifdef __linux__
+        struct stat in;
+        if ( ( stat ( name->c_str(), &in ) == 0 ) && ( in.st_dev == out.st_dev ) && ( in.st_ino == out.st_ino ) ) {
+            return true;
+        }
+#endif
+    }
+    return false;
+}
+
+void saveTrace ( void )
+{
+#ifdef WADMERGE_TRACE
+    if ( !tracefile.empty() && !Trace::write ( tracefile.c_str() ) ) {
+        std::cout << "Error writing trace : " << tracefile << std::endl;
+    }
+#endif
+}
+
+int mergeLoaded ( std::vector< Wad >& inputfiles, Wad* base, unsigned int flags, int threads, const std::string& outputfile )
+{
+    // Merges wads which have all been loaded, and saves the result.
+    Wad output;
+    int optimalHashSize = 0;
+    std::string savefile = outputfile;
+
+    // We'll determine the optimal hashsize.  The size doesn't really matter, but we get more speed when it can cover
+    // the largest wad file we can create.
+
+    for ( std::vector< Wad >::const_iterator c = inputfiles.begin(); c != inputfiles.end(); ++c ) {
+        optimalHashSize += c->getNumLumps();
+    }
+
+    optimalHashSize = findHigherPrime ( optimalHashSize ); // We then find the next prime number.
+    output.setHashSize ( optimalHashSize ); // and set it.  Note that we can still merge wads
+    // without setting a hash value.  Duplicates will simply be found using a slower method instead.
+    output.setLastWins ( flags & F_LAST_WINS );
+    output.setClusterLayout ( flags & F_CLUSTER );
+
+    std::cout << "Merging...\n";
+
+    for ( std::vector < Wad >::iterator c = inputfiles.begin(); c != inputfiles.end(); ++c ) {
+        setOutputType ( output, *c, flags );
+    }
+    output.mergeWads ( inputfiles, flags & F_ALLOW_DUPLICATES, threads );
+
+    if ( ( flags & F_WATCH ) && ! ( flags & F_EXTRACT ) ) {
+        // Whatever is using the output may be reading it, so write a new one and rename it over the old.
+        savefile += ".tmp";
+    }
+
+    if ( finishOutput ( output, base, flags, outputfile, savefile, nullptr ) != 0 ) {
+        return 1;
+    }
+
+    if ( ( savefile != outputfile ) && ( std::rename ( savefile.c_str(), outputfile.c_str() ) != 0 ) ) {
+        std::cout << "Error renaming " << savefile << " to " << outputfile << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+#ifdef __linux__
+int watchInputs ( const std::vector< std::string >& inputnames, std::vector< Wad >& inputfiles, Wad* base, unsigned int flags, int threads, const std::string& outputfile )
+{
+    // Waits for any of the input wads to change, reloads just those, and merges again.
+    // The directories are watched rather than the files, as editors often save by writing a
+    // new file and renaming it over the old one.  An input which is an extracted directory is
+    // also watched itself, so editing any lump in it, or its index, counts as a change.
+    int fd = inotify_init();
+    std::vector< int > watches;
+    std::vector< int > contentWatches; // -1 unless the input is a directory.
+    std::vector< std::string > filenames;
+    const uint32_t contentEvents = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE;
+    char buffer[4096] __attribute__ ( ( aligned ( __alignof__ ( struct inotify_event ) ) ) );
+
+    if ( fd < 0 ) {
+        std::cout << "Unable to watch for changes.\n";
+        return 1;
+    }
+
+    for ( std::vector< std::string >::const_iterator it = inputnames.begin(); it != inputnames.end(); ++it ) {
+        std::string name = *it;
+        struct stat info;
+
+        while ( ( name.size() > 1 ) && ( name[name.size() - 1] == '/' ) ) {
+            name.erase ( name.size() - 1 ); // "dir/" is the entry "dir" in its parent.
+        }
+
+        size_t slash = name.rfind ( '/' );
+        std::string dir = ( slash == std::string::npos ) ? "." : ( slash == 0 ? "/" : name.substr ( 0, slash ) );
+
+        watches.push_back ( inotify_add_watch ( fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO ) );
+        filenames.push_back ( ( slash == std::string::npos ) ? name : name.substr ( slash + 1 ) );
+
+        bool isdir = ( stat ( it->c_str(), &info ) == 0 ) && S_ISDIR ( info.st_mode );
+        contentWatches.push_back ( isdir ? inotify_add_watch ( fd, it->c_str(), contentEvents ) : -1 );
+
+        if ( ( watches.back() < 0 ) || ( isdir && ( contentWatches.back() < 0 ) ) ) {
+            std::cout << "Unable to watch for changes : " << *it << std::endl;
+            close ( fd );
+            return 1;
+        }
+    }
+
+    std::cout << "Watching for changes.  Press Ctrl-C to stop.\n";
+
+    while ( true ) {
+        std::vector< bool > changed ( inputnames.size(), false );
+        bool anychanged = false;
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        int timeout = -1; // Wait as long as it takes for the first change.
+
+        // Once something has changed, keep collecting events until things have been quiet for a moment,
+        // so a save made in several steps only causes one merge.
+        while ( poll ( &pfd, 1, timeout ) > 0 ) {
+            ssize_t len = read ( fd, buffer, sizeof ( buffer ) );
+
+            for ( char *ptr = buffer; ( len > 0 ) && ( ptr < buffer + len ); ) {
+                const struct inotify_event *event = reinterpret_cast< const struct inotify_event * > ( ptr );
+
+                for ( unsigned int x = 0; x < inputnames.size(); ++x ) {
+                    if ( ( event->len > 0 ) && ( event->wd == watches[x] ) && ( filenames[x] == event->name ) ) {
+                        changed[x] = true;
+                        anychanged = true;
+                    } else if ( ( contentWatches[x] >= 0 ) && ( event->wd == contentWatches[x] ) ) {
+                        changed[x] = true;
+                        anychanged = true;
+                    }
+                }
+                ptr += sizeof ( struct inotify_event ) + event->len;
+            }
+            timeout = anychanged ? watchSettleTime : -1;
+        }
+
+        bool reloaded = false;
+
+        for ( unsigned int x = 0; x < inputnames.size(); ++x ) {
+            if ( changed[x] ) {
+                std::cout << "Reloading " << inputnames[x] << std::endl;
+                try {
+                    inputfiles[x] = Wad ( inputnames[x].c_str() );
+                    if ( flags & F_COMPRESS ) {
+                        inputfiles[x].compress();
+                    }
+                    if ( contentWatches[x] >= 0 ) {
+                        // The directory may have been replaced by a new one of the same name.
+                        contentWatches[x] = inotify_add_watch ( fd, inputnames[x].c_str(), contentEvents );
+                    }
+                    reloaded = true;
+                } catch ( std::string &err ) {
+                    // Keep the previous version, in case this is a save which hasn't finished yet.
+                    std::cout << err << " : " << inputnames[x] << std::endl;
+                }
+            }
+        }
+
+        if ( reloaded ) {
+            mergeLoaded ( inputfiles, base, flags, threads, outputfile );
+            saveTrace();
+        }
+    }
+    return 0;
+}
+#endif
+
 
 int main ( int argc, char **argv )
 {
     int optch;
     int optimalHashSize = 0;
+    int threads = 1;
     std::vector < Wad > inputfiles;
+    std::vector < std::string > inputnames;
     std::string outputfile;
-    unsigned char flags = 0;
+    std::string basefile;
+    unsigned int flags = 0;
+    int status;
 
     std::cout << "WADMERGE: Joins/merges WAD files for Doom and Doom engine based games.\n"
               << "(C) Dennis Katsonis (2014).\t\tVersion " << VERSION << "\n\n";
@@ -83,7 +345,7 @@ int main ( int argc, char **argv )
     }
 
 
-    while ( ( optch = getopt ( argc, argv, "dVIo:i:Pc" ) ) != -1 ) {
+    while ( ( optch = getopt ( argc, argv, "dVIo:i:Pcb:lpj:wT:x:za" ) ) != -1 ) {
         switch ( optch ) {
         case 'V':
             printLicense();
@@ -105,25 +367,59 @@ int main ( int argc, char **argv )
         case 'c':
             flags |= F_DEDUP;
             break;
+        case 'l':
+            flags |= F_LAST_WINS;
+            break;
         case 'o':
+        case 'x':
+            if ( !outputfile.empty() ) {
+                std::cout << "Only one output can be given.\n";
+                return 1;
+            }
             outputfile = optarg;
+            if ( optch == 'x' ) {
+                flags |= F_EXTRACT;
+            }
             break;
-        case 'i':
-            std::cout << "Loading " << optarg << std::endl;
-            try {
-                // 'Wad' class may throw an exception of the file
-                // specified by 'optarg' is not a valid and complete .WAD file.
-                inputfiles.emplace_back ( Wad ( optarg ) );
-            } catch ( std::string &err ) {
-                std::cout << err << " : " << optarg << std::endl;
-                exit ( 1 );
+        case 'b':
+            basefile = optarg;
+            break;
+        case 'p':
+            flags |= F_PIPELINE;
+            break;
+        case 'w':
+            flags |= F_WATCH;
+            break;
+        case 'z':
+            flags |= F_COMPRESS;
+            break;
+        case 'a':
+            flags |= F_CLUSTER;
+            break;
+        case 'T':
+#ifdef WADMERGE_TRACE
+            tracefile = optarg;
+            Trace::start();
+#else
+            std::cout << "This wadmerge was built without trace support.\n";
+            return 1;
+#endif
+            break;
+        case 'j':
+            threads = atoi ( optarg );
+            if ( threads < 1 ) {
+                std::cout << "Number of threads must be at least 1.\n";
+                return 1;
             }
             break;
+        case 'i':
+            inputnames.push_back ( optarg );
+            break;
 
         }			// End switch.
     }				// End while.
 
-    if ( inputfiles.size() == 0 ) {
+    if ( inputnames.size() == 0 ) {
         std::cout << "No input WAD files specified.\n";
         return -1;
     }
@@ -131,51 +427,133 @@ int main ( int argc, char **argv )
         std::cout << "No valid output WAD files specified.\n";
         return -1;
     }
+    if ( ( flags & F_WATCH ) && ( flags & F_PIPELINE ) ) {
+        std::cout << "Can't watch for changes in pipelined mode.\n";
+        return 1;
+    }
+    if ( ( flags & F_WATCH ) && ( std::find ( inputnames.begin(), inputnames.end(), "-" ) != inputnames.end() ) ) {
+        std::cout << "Can't watch standard input for changes.\n";
+        return 1;
+    }
+    if ( !basefile.empty() && ( flags & F_IWAD ) ) {
+        std::cout << "Output against a base wad is always a PWAD.\n";
+        return 1;
+    }
+
+    std::unique_ptr< Wad > base;
+
+    if ( !basefile.empty() ) {
+        try {
+            base.reset ( new Wad ( basefile.c_str() ) );
+            if ( flags & F_COMPRESS ) {
+                base->compress();
+            }
+        } catch ( std::string &err ) {
+            std::cout << err << " : " << basefile << std::endl;
+            exit ( 1 );
+        }
+    }
+
+    if ( ! ( flags & F_PIPELINE ) ) {
+        inputfiles.reserve ( inputnames.size() );
+        for ( std::vector< std::string >::const_iterator name = inputnames.begin(); name != inputnames.end(); ++name ) {
+            std::cout << "Loading " << *name << std::endl;
+            try {
+                // 'Wad' class may throw an exception of the file
+                // specified by 'name' is not a valid and complete .WAD file.
+                inputfiles.emplace_back ( name->c_str() );
+                if ( flags & F_COMPRESS ) {
+                    inputfiles.back().compress();
+                }
+            } catch ( std::string &err ) {
+                std::cout << err << " : " << *name << std::endl;
+                exit ( 1 );
+            }
+        }
+
+        if ( flags & F_WATCH ) {
+#ifdef __linux__
+            mergeLoaded ( inputfiles, base.get(), flags, threads, outputfile ); // A failure here might be fixed by the next change.
+            saveTrace();
+            return watchInputs ( inputnames, inputfiles, base.get(), flags, threads, outputfile );
+#else
+            std::cout << "Watching for changes is only available on Linux.\n";
+            return 1;
+#endif
+        }
+        status = mergeLoaded ( inputfiles, base.get(), flags, threads, outputfile );
+        saveTrace();
+        return status;
+    }
 
     Wad output;
+    std::unique_ptr< LumpWriter > writer;
 
     // We'll determine the optimal hashsize.  The size doesn't really matter, but we get more speed when it can cover
-    // the largest wad file we can create.
+    // the largest wad file we can create.  The wads aren't loaded yet, so this reads just their headers.
 
-    for ( std::vector< Wad >::const_iterator c = inputfiles.begin(); c != inputfiles.end(); ++c ) {
-        optimalHashSize += c->getNumLumps();
+    for ( std::vector< std::string >::const_iterator name = inputnames.begin(); name != inputnames.end(); ++name ) {
+        try {
+            optimalHashSize += Wad::readNumLumps ( name->c_str() );
+        } catch ( std::string &err ) {
+            std::cout << err << " : " << *name << std::endl;
+            exit ( 1 );
+        }
     }
 
     optimalHashSize = findHigherPrime ( optimalHashSize ); // We then find the next prime number.
-    output.setHashSize ( optimalHashSize ); // and set it.  Note that we can still merge wads
-    // without setting a hash value.  Duplicates will simply be found using a slower method instead.
+    output.setHashSize ( optimalHashSize );
+    output.setLastWins ( flags & F_LAST_WINS );
+    output.setClusterLayout ( flags & F_CLUSTER );
 
     std::cout << "Merging...\n";
 
-    for ( std::vector < Wad >::iterator c = inputfiles.begin(); c != inputfiles.end(); ++c ) {
-        // If any wads are IWADS and user hasn't selected an option, make the ouput IWAD. PWAD is default.
-        if ( ! ( flags & F_IWAD ) && ! ( flags & F_PWAD ) ) {
-            if ( c->wadType() == WAD_IWAD ) {
-                output.wadType ( WAD_IWAD );
-            }
+    // Lump data can only be written as it's merged if nothing will later replace or remove it.
+    // Nor if it is to be laid out by kind, which needs all of it first.
+    // It goes to a temporary name, renamed over the output once complete, so a failed merge doesn't
+    // leave a broken wad behind.  Nor when the output is also an input, which must be read first.
+    std::string streamfile = outputfile + ".tmp";
+    if ( ! ( flags & ( F_DEDUP | F_LAST_WINS | F_EXTRACT | F_CLUSTER ) ) && !base && !namesInput ( outputfile, inputnames ) ) {
+        try {
+            writer.reset ( new LumpWriter ( streamfile.c_str() ) );
+        } catch ( std::string &err ) {
+            std::cout << err << " : " << streamfile << std::endl;
+            std::remove ( streamfile.c_str() );
+            exit ( 1 );
         }
-        output.mergeWad ( *c, flags & F_ALLOW_DUPLICATES );
+        output.streamTo ( writer.get() );
     }
 
-    if ( flags & F_IWAD ) { // If the user has selected IWAD or PWAD, override.
-        output.wadType ( WAD_IWAD );
-    } else if ( flags & F_PWAD ) {
-        output.wadType ( WAD_PWAD );
-    }
-
-    std::cout << "Writing " << outputfile << "..." << std::endl;
+    WadLoader loader ( inputnames, loaderLookahead, flags & F_COMPRESS );
+    LoadedWad loaded;
 
-    if ( flags & F_DEDUP ) {
-        std::cout << "Deduplicating...\n";
-        output.deduplicate();
-    }
-    try {
-        output.save ( outputfile.c_str () );
-    } catch ( std::string &err ) {
-        std::cout << err << " : " << optarg << std::endl;
-        exit ( 1 );
+    while ( loader.next ( loaded ) ) {
+        if ( !loaded.wad ) {
+            std::cout << loaded.error << " : " << loaded.filename << std::endl;
+            if ( writer ) {
+                writer.reset();
+                std::remove ( streamfile.c_str() );
+            }
+            exit ( 1 );
+        }
+        std::cout << "Loaded " << loaded.filename << std::endl;
+        setOutputType ( output, *loaded.wad, flags );
+        output.mergeWad ( *loaded.wad, flags & F_ALLOW_DUPLICATES );
     }
-    output.stats();
 
-    return 0;
+    if ( !writer ) {
+        status = finishOutput ( output, base.get(), flags, outputfile, outputfile, nullptr );
+    } else {
+        status = finishOutput ( output, base.get(), flags, outputfile, streamfile, writer.get() );
+        writer.reset();
+        if ( status != 0 ) {
+            std::remove ( streamfile.c_str() );
+        } else if ( std::rename ( streamfile.c_str(), outputfile.c_str() ) != 0 ) {
+            std::cout << "Error renaming " << streamfile << " to " << outputfile << std::endl;
+            std::remove ( streamfile.c_str() );
+            status = 1;
+        }
+    }
+    saveTrace();
+    return status;
 }
@@ -0,0 +1,137 @@
+/*
+ * Wadmerge: Merges WAD files used for Doom/Doom2/Hexen/Heretic
+ * Copyright (C) 2014  Dennis Katsonis dennisk@netspace.net.au
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "pipeline.h"
+#include "trace.h"
+
+
+const int wadHeaderLength = 12; // The length in bytes of the WAD header.
+const size_t lumpWriterQueueLength = 256; // Lumps waiting to be written before the merge has to wait.
+
+WadLoader::WadLoader ( const std::vector< std::string >& files, size_t lookahead, bool compressData ) : filenames ( files ), queue ( lookahead ), compress ( compressData )
+{
+    worker = std::thread ( &WadLoader::run, this );
+}
+
+WadLoader::~WadLoader()
+{
+    queue.close(); // In case we are stopping early, unblock the loader.
+    if ( worker.joinable() ) {
+        worker.join();
+    }
+}
+
+void WadLoader::run()
+{
+    for ( std::vector< std::string >::const_iterator it = filenames.begin(); it != filenames.end(); ++it ) {
+        LoadedWad loaded;
+        loaded.filename = *it;
+
+        try {
+            loaded.wad.reset ( new Wad ( it->c_str() ) );
+            if ( compress ) {
+                loaded.wad->compress();
+            }
+        } catch ( std::string &err ) {
+            loaded.error = err;
+        }
+
+        bool failed = !loaded.wad;
+
+        if ( !queue.push ( std::move ( loaded ) ) || failed ) {
+            break; // Nothing after a failed wad will be used.
+        }
+    }
+    queue.close();
+}
+
+bool WadLoader::next ( LoadedWad& loaded )
+{
+    return queue.pop ( loaded );
+}
+
+
+LumpWriter::LumpWriter ( const char* filename ) : queue ( lumpWriterQueueLength ), offset ( wadHeaderLength ), failed ( false ), finished ( false )
+{
+    fout.exceptions ( std::ofstream::failbit | std::ofstream::badbit );
+
+    try {
+        fout.open ( filename, std::ios_base::binary );
+        fout.seekp ( wadHeaderLength, std::ios::beg ); // The header is written last.
+    } catch ( std::ofstream::failure &e ) {
+        throw ( std::string ( "Error saving file." ) );
+    }
+    worker = std::thread ( &LumpWriter::run, this );
+}
+
+LumpWriter::~LumpWriter()
+{
+    queue.close();
+    if ( worker.joinable() ) {
+        worker.join();
+    }
+}
+
+void LumpWriter::run()
+{
+    PendingLump lump;
+    TRACE_SCOPE ( "write lump data" );
+
+    while ( queue.pop ( lump ) ) {
+        if ( failed ) {
+            continue; // Keep taking lumps, so the merge doesn't block on a full queue.
+        }
+        try {
+            fout.write ( lump.data.get(), lump.size );
+        } catch ( std::ofstream::failure &e ) {
+            failed = true;
+        }
+    }
+}
+
+int LumpWriter::append ( const std::shared_ptr<char>& data, int size )
+{
+    int location = offset;
+    PendingLump lump;
+
+    lump.data = data; // Holding the pointer keeps the data alive until written.
+    lump.size = size;
+    queue.push ( std::move ( lump ) );
+    offset += size;
+    return location;
+}
+
+int LumpWriter::getOffset() const
+{
+    return offset;
+}
+
+std::ofstream& LumpWriter::finish()
+{
+    if ( !finished ) {
+        queue.close();
+        worker.join();
+        finished = true;
+    }
+
+    if ( failed ) {
+        throw ( std::string ( "Error saving file." ) );
+    }
+    return fout;
+}
@@ -0,0 +1,132 @@
+/*
+ * Wadmerge: Merges WAD files used for Doom/Doom2/Hexen/Heretic
+ * Copyright (C) 2014  Dennis Katsonis dennisk@netspace.net.au
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <fstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "wad.h"
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+// A queue with a fixed capacity, for passing work from one thread to the next.
+// push() blocks while the queue is full, so a fast stage can't run too far ahead of a slow one.
+template<typename T>
+class BoundedQueue
+{
+private:
+    std::deque< T > items;
+    size_t capacity;
+    bool closed;
+    std::mutex lock;
+    std::condition_variable notFull;
+    std::condition_variable notEmpty;
+
+public:
+    explicit BoundedQueue ( size_t cap ) : capacity ( cap ), closed ( false ) {}
+
+    bool push ( T&& item ) {
+        // Returns false if the queue has been closed.
+        std::unique_lock< std::mutex > guard ( lock );
+        notFull.wait ( guard, [this] { return closed || ( items.size() < capacity ); } );
+        if ( closed ) {
+            return false;
+        }
+        items.push_back ( std::move ( item ) );
+        notEmpty.notify_one();
+        return true;
+    }
+
+    bool pop ( T& item ) {
+        // Returns false once the queue has been closed and everything in it taken.
+        std::unique_lock< std::mutex > guard ( lock );
+        notEmpty.wait ( guard, [this] { return closed || !items.empty(); } );
+        if ( items.empty() ) {
+            return false;
+        }
+        item = std::move ( items.front() );
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+
+    void close() {
+        std::lock_guard< std::mutex > guard ( lock );
+        closed = true;
+        notFull.notify_all();
+        notEmpty.notify_all();
+    }
+};
+
+
+struct LoadedWad {
+    std::string filename;
+    std::unique_ptr< Wad > wad; // Empty if loading failed.
+    std::string error;
+};
+
+// Loads a list of wads in order on its own thread, so the next one can be read while
+// the current one is being merged.
+class WadLoader
+{
+private:
+    std::vector< std::string > filenames;
+    BoundedQueue< LoadedWad > queue;
+    bool compress; // Compress the lump data of each wad once loaded.
+    std::thread worker;
+    void run();
+
+public:
+    WadLoader ( const std::vector< std::string >& files, size_t lookahead, bool compressData );
+    ~WadLoader();
+    bool next ( LoadedWad& loaded ); // Returns false when all wads have been handed over.
+};
+
+// Writes lump data to the output file on its own thread, as soon as the lump has been
+// accepted into the output wad.  Lumps are written one after the other from the end of the
+// header, so their location is known as soon as they are appended.
+class LumpWriter
+{
+private:
+    struct PendingLump {
+        std::shared_ptr<char> data;
+        int size;
+    };
+    std::ofstream fout;
+    BoundedQueue< PendingLump > queue;
+    std::thread worker;
+    int offset; // Where the next lump appended will go.
+    bool failed;
+    bool finished;
+    void run();
+
+public:
+    explicit LumpWriter ( const char* filename );
+    ~LumpWriter();
+    int append ( const std::shared_ptr<char>& data, int size );
+    int getOffset() const;
+    std::ofstream& finish(); // Waits for all lump data to be written.
+};
+
+#endif // PIPELINE_H
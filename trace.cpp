@@ -0,0 +1,131 @@
+/*
+ * Wadmerge: Merges WAD files used for Doom/Doom2/Hexen/Heretic
+ * Copyright (C) 2014  Dennis Katsonis dennisk@netspace.net.au
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "trace.h"
+
+#ifdef WADMERGE_TRACE
+
+#include <vector>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+
+struct TraceEvent {
+    const char *name;
+    std::string detail;
+    char phase; // 'X' for a span, 'i' for an instant.
+    uint64_t begin;
+    uint64_t duration;
+    int thread;
+};
+
+static std::atomic< bool > traceEnabled ( false );
+static std::mutex traceLock;
+static std::vector< TraceEvent > traceEvents;
+static std::map< std::thread::id, int > traceThreads; // Small numbers are easier to read than thread ids.
+static std::chrono::steady_clock::time_point traceStart;
+
+static int threadNumber()
+{
+    // Must be called with traceLock held.
+    std::map< std::thread::id, int >::iterator it = traceThreads.find ( std::this_thread::get_id() );
+
+    if ( it == traceThreads.end() ) {
+        it = traceThreads.insert ( std::make_pair ( std::this_thread::get_id(), static_cast<int> ( traceThreads.size() ) + 1 ) ).first;
+    }
+    return it->second;
+}
+
+static std::string escape ( const std::string& str )
+{
+    std::string out;
+
+    for ( std::string::const_iterator c = str.begin(); c != str.end(); ++c ) {
+        if ( ( *c == '"' ) || ( *c == '\\' ) ) {
+            out += '\\';
+            out += *c;
+        } else if ( static_cast<unsigned char> ( *c ) < 0x20 ) {
+            out += ' ';
+        } else {
+            out += *c;
+        }
+    }
+    return out;
+}
+
+void Trace::start()
+{
+    traceStart = std::chrono::steady_clock::now();
+    traceEnabled = true;
+}
+
+bool Trace::enabled()
+{
+    return traceEnabled.load ( std::memory_order_relaxed );
+}
+
+uint64_t Trace::now()
+{
+    // Microseconds since tracing started, which is the unit the trace format uses.
+    return std::chrono::duration_cast< std::chrono::microseconds > ( std::chrono::steady_clock::now() - traceStart ).count();
+}
+
+void Trace::complete ( const char* name, const std::string& detail, uint64_t begin, uint64_t end )
+{
+    std::lock_guard< std::mutex > guard ( traceLock );
+    TraceEvent event = { name, detail, 'X', begin, end - begin, threadNumber() };
+    traceEvents.push_back ( event );
+}
+
+void Trace::instant ( const char* name, const std::string& detail )
+{
+    uint64_t when = now();
+    std::lock_guard< std::mutex > guard ( traceLock );
+    TraceEvent event = { name, detail, 'i', when, 0, threadNumber() };
+    traceEvents.push_back ( event );
+}
+
+bool Trace::write ( const char* filename )
+{
+    std::lock_guard< std::mutex > guard ( traceLock );
+    std::ofstream fout ( filename );
+
+    fout << "{\"traceEvents\":[\n";
+    for ( std::vector< TraceEvent >::const_iterator it = traceEvents.begin(); it != traceEvents.end(); ++it ) {
+        fout << ( it == traceEvents.begin() ? "" : ",\n" )
+             << "{\"name\":\"" << it->name << "\",\"ph\":\"" << it->phase << "\",\"ts\":" << it->begin
+             << ",\"pid\":1,\"tid\":" << it->thread;
+        if ( it->phase == 'X' ) {
+            fout << ",\"dur\":" << it->duration;
+        } else {
+            fout << ",\"s\":\"t\"";
+        }
+        if ( !it->detail.empty() ) {
+            fout << ",\"args\":{\"detail\":\"" << escape ( it->detail ) << "\"}";
+        }
+        fout << "}";
+    }
+    fout << "\n],\"displayTimeUnit\":\"ms\"}\n";
+    return static_cast<bool> ( fout );
+}
+
+#endif // WADMERGE_TRACE
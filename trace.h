@@ -0,0 +1,80 @@
+/*
+ * Wadmerge: Merges WAD files used for Doom/Doom2/Hexen/Heretic
+ * Copyright (C) 2014  Dennis Katsonis dennisk@netspace.net.au
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+// Records a timeline of what wadmerge spends its time on, written out in the Chrome
+// trace event format (viewable in chrome://tracing or Perfetto).
+//
+// Use the macros rather than the classes directly.  Without WADMERGE_TRACE defined they
+// compile to nothing, and their arguments are never evaluated.
+//
+//   TRACE_SCOPE ( name )             Span from here to the end of the enclosing block.
+//   TRACE_SCOPE_ARG ( name, detail ) As above, with a string shown with the span.
+//   TRACE_INSTANT ( name, detail )   A single point in time.
+
+#ifdef WADMERGE_TRACE
+
+#include <string>
+#include <stdint.h>
+
+class Trace
+{
+public:
+    static void start();
+    static bool enabled();
+    static uint64_t now();
+    static void complete ( const char* name, const std::string& detail, uint64_t begin, uint64_t end );
+    static void instant ( const char* name, const std::string& detail );
+    static bool write ( const char* filename );
+};
+
+class TraceScope
+{
+private:
+    const char *name;
+    std::string detail;
+    uint64_t begin;
+
+public:
+    TraceScope ( const char* spanName ) : name ( spanName ), begin ( Trace::enabled() ? Trace::now() : 0 ) {}
+    TraceScope ( const char* spanName, const std::string& spanDetail ) : name ( spanName ), detail ( Trace::enabled() ? spanDetail : std::string() ), begin ( Trace::enabled() ? Trace::now() : 0 ) {}
+    ~TraceScope() {
+        if ( Trace::enabled() ) {
+            Trace::complete ( name, detail, begin, Trace::now() );
+        }
+    }
+};
+
+#define TRACE_CONCAT2(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT2(a, b)
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(traceScope, __LINE__) ( name )
+#define TRACE_SCOPE_ARG(name, detail) TraceScope TRACE_CONCAT(traceScope, __LINE__) ( name, detail )
+#define TRACE_INSTANT(name, detail) do { if ( Trace::enabled() ) Trace::instant ( name, detail ); } while ( 0 )
+
+#else
+
+#define TRACE_SCOPE(name) do { } while ( 0 )
+#define TRACE_SCOPE_ARG(name, detail) do { } while ( 0 )
+#define TRACE_INSTANT(name, detail) do { } while ( 0 )
+
+#endif // WADMERGE_TRACE
+
+#endif // TRACE_H
@@ -0,0 +1,4 @@
+#ifndef VERSION_H
+#define VERSION_H
+#define VERSION "1.0.2"
+#endif
@@ -22,8 +22,27 @@
 #include <fstream>
 #include <cstring>
 #include <iterator>
+#include <cctype>
+#include <atomic>
+#include <sstream>
 #include <stdio.h>
+#include <thread>
+#include <system_error>
+#include <unordered_set>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#include <io.h>
+#include <fcntl.h>
+#endif
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 #include "wad.h"
+#include "pipeline.h"
+#include "trace.h"
+#include "lz.h"
 
 
 const int numGroupTypes = 9; // Number of lump groupings.  This refers
@@ -32,6 +51,25 @@ const int lumpNameLength = 8; // The length of the lumpname in the WAD file.
 const int wadLumpBeginOffset = 12; // The length in bytes of the WAD header.
 const int mapEntries = 15; // The number of lump entries which make up a map for Doom (Hexen has one more).
 const int glMapEntries = 5; // The number of lump entries for GL Nodes.
+const char *packIndexName = "wadmerge.idx"; // Lists the lumps of an extracted wad, in order.
+const int readGapLimit = 65536; // Gaps between lumps larger than this are skipped rather than read.
+const int minPackSize = 64; // Smaller lumps aren't worth compressing.
+const size_t estimateBlockSize = 1 << 20; // Data is compressed this much at a time to estimate its compressed size.
+const unsigned int mergeThreadsPerCore = 2; // More merge threads than this would only wait on each other.
+
+// The kinds of lump that clusterOrder() groups together, in the order they are laid out.
+enum lumpKinds {
+    K_TEXT,
+    K_PALETTE,
+    K_MAP,
+    K_FLAT,
+    K_SPRITE,
+    K_PATCH,
+    K_SOUND,
+    K_MUSIC,
+    K_IMAGE,
+    K_GENERAL
+};
 
 int findHigherPrime ( int start )
 {
@@ -68,6 +106,19 @@ unsigned long hash ( const char *str )
     return hash;
 }
 
+uint64_t fingerprint ( const char *data, int size )
+{
+    // 64 bit FNV-1a.  Used to compare lump contents without comparing the data itself.
+    uint64_t hash = 14695981039346656037ULL;
+
+    for ( int x = 0; x < size; ++x ) {
+        hash ^= static_cast<unsigned char> ( data[x] );
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
 
 const char *maplumpnames[] = {
     "THINGS",
@@ -89,42 +140,81 @@ const char *maplumpnames[] = {
 };
 
 
-Wad::Wad ( const Wad& obj )
+Wad::Wad ( const Wad& obj ) : groupEndOffsets ( obj.groupEndOffsets ), wad_id ( obj.wad_id ), numlumps ( obj.numlumps ), iwad ( obj.iwad ), type ( obj.type ), sorted ( obj.sorted ), dirloc ( obj.dirloc ), hashsize ( obj.hashsize ), duplicatesFound ( obj.duplicatesFound ), numDeduplicated ( obj.numDeduplicated ), numDeltaRemoved ( obj.numDeltaRemoved ), numReplaced ( obj.numReplaced ), numMapsShared ( obj.numMapsShared ), lastWins ( obj.lastWins ), clusterLayout ( obj.clusterLayout ), lumpIndex ( obj.lumpIndex ), writer ( nullptr ), wadGameType ( obj.wadGameType ), hasher ( obj.hasher ), hasherInitialised ( obj.hasherInitialised ), names ( obj.names ), sizes ( obj.sizes ), locations ( obj.locations ), types ( obj.types ), fingerprints ( obj.fingerprints ), dedupOf ( obj.dedupOf ), packedSizes ( obj.packedSizes ), lumpdata ( obj.lumpdata ), mapFingerprints ( obj.mapFingerprints ), mergedMaps ( obj.mergedMaps ), mapConflicts ( obj.mapConflicts )
 {
-    numlumps = obj.numlumps;
-    sorted = obj.sorted;
-    type = obj.type;
-    wad_id = obj.wad_id;
-    dirloc = obj.dirloc;
-    wadlump = obj.wadlump;
-    wadGameType = obj.wadGameType;
+    // Private, so that copies are only made on purpose through clone().  The copy shares
+    // the lump data with the original.
+}
+
+Wad::Wad ( Wad&& obj ) noexcept : groupEndOffsets ( std::move ( obj.groupEndOffsets ) ), wad_id ( obj.wad_id ), numlumps ( obj.numlumps ), iwad ( obj.iwad ), type ( obj.type ), sorted ( obj.sorted ), dirloc ( obj.dirloc ), hashsize ( obj.hashsize ), duplicatesFound ( obj.duplicatesFound ), numDeduplicated ( obj.numDeduplicated ), numDeltaRemoved ( obj.numDeltaRemoved ), numReplaced ( obj.numReplaced ), numMapsShared ( obj.numMapsShared ), lastWins ( obj.lastWins ), clusterLayout ( obj.clusterLayout ), lumpIndex ( std::move ( obj.lumpIndex ) ), writer ( obj.writer ), wadGameType ( obj.wadGameType ), hasher ( std::move ( obj.hasher ) ), hasherInitialised ( obj.hasherInitialised ), names ( std::move ( obj.names ) ), sizes ( std::move ( obj.sizes ) ), locations ( std::move ( obj.locations ) ), types ( std::move ( obj.types ) ), fingerprints ( std::move ( obj.fingerprints ) ), dedupOf ( std::move ( obj.dedupOf ) ), packedSizes ( std::move ( obj.packedSizes ) ), lumpdata ( std::move ( obj.lumpdata ) ), mapFingerprints ( std::move ( obj.mapFingerprints ) ), mergedMaps ( std::move ( obj.mergedMaps ) ), mapConflicts ( std::move ( obj.mapConflicts ) )
+{
+    obj.numlumps = 0;
+    obj.writer = nullptr;
 }
 
-Wad::Wad ( Wad&& obj )
+Wad& Wad::operator= ( Wad&& obj ) noexcept
 {
+    groupEndOffsets = std::move ( obj.groupEndOffsets );
+    wad_id = obj.wad_id;
     numlumps = obj.numlumps;
-    sorted = obj.sorted;
+    iwad = obj.iwad;
     type = obj.type;
-    wad_id = std::move ( obj.wad_id );
+    sorted = obj.sorted;
     dirloc = obj.dirloc;
-    wadlump = std::move ( obj.wadlump );
+    hashsize = obj.hashsize;
+    duplicatesFound = obj.duplicatesFound;
+    numDeduplicated = obj.numDeduplicated;
+    numDeltaRemoved = obj.numDeltaRemoved;
+    numReplaced = obj.numReplaced;
+    numMapsShared = obj.numMapsShared;
+    lastWins = obj.lastWins;
+    clusterLayout = obj.clusterLayout;
+    lumpIndex = std::move ( obj.lumpIndex );
+    writer = obj.writer;
     wadGameType = obj.wadGameType;
+    hasher = std::move ( obj.hasher );
+    hasherInitialised = obj.hasherInitialised;
+    names = std::move ( obj.names );
+    sizes = std::move ( obj.sizes );
+    locations = std::move ( obj.locations );
+    types = std::move ( obj.types );
+    fingerprints = std::move ( obj.fingerprints );
+    dedupOf = std::move ( obj.dedupOf );
+    packedSizes = std::move ( obj.packedSizes );
+    lumpdata = std::move ( obj.lumpdata );
+    mapFingerprints = std::move ( obj.mapFingerprints );
+    mergedMaps = std::move ( obj.mergedMaps );
+    mapConflicts = std::move ( obj.mapConflicts );
+    obj.numlumps = 0;
+    obj.writer = nullptr;
+    return *this;
 }
 
+Wad Wad::clone() const
+{
+    return Wad ( *this );
+}
 
-Wad::Wad() : numlumps ( 0 ), type ( WAD_PWAD ), sorted ( false ), dirloc ( wadLumpBeginOffset ), hashsize ( 0 ), duplicatesFound ( 0 ), numDeduplicated ( 0 ), wadGameType ( G_UNKNOWN ),  hasherInitialised ( false )
+
+Wad::Wad() : numlumps ( 0 ), type ( WAD_PWAD ), sorted ( false ), dirloc ( wadLumpBeginOffset ), hashsize ( 0 ), duplicatesFound ( 0 ), numDeduplicated ( 0 ), numDeltaRemoved ( 0 ), numReplaced ( 0 ), numMapsShared ( 0 ), lastWins ( false ), clusterLayout ( false ), writer ( nullptr ), wadGameType ( G_UNKNOWN ),  hasherInitialised ( false )
 {
     groupEndOffsets.resize ( numGroupTypes );
     this->wadType ( WAD_PWAD ); // Default to PWAD
 }
 
-Wad::Wad ( const char* filename ) : numlumps ( 0 ), type ( WAD_PWAD ), sorted ( false ), dirloc ( wadLumpBeginOffset ),  hashsize ( 0 ), duplicatesFound ( 0 ), numDeduplicated ( 0 ), wadGameType ( G_UNKNOWN ), hasherInitialised ( false )
+Wad::Wad ( const char* filename ) : numlumps ( 0 ), type ( WAD_PWAD ), sorted ( false ), dirloc ( wadLumpBeginOffset ),  hashsize ( 0 ), duplicatesFound ( 0 ), numDeduplicated ( 0 ), numDeltaRemoved ( 0 ), numReplaced ( 0 ), numMapsShared ( 0 ), lastWins ( false ), clusterLayout ( false ), writer ( nullptr ), wadGameType ( G_UNKNOWN ), hasherInitialised ( false )
 {
     groupEndOffsets.resize ( numGroupTypes );
     this->load ( filename );
 }
 
-Wadlumpdata & Wad::operator[] ( int entrynum )
+Wad::Wad ( const std::shared_ptr<char>& buffer, size_t size ) : numlumps ( 0 ), type ( WAD_PWAD ), sorted ( false ), dirloc ( wadLumpBeginOffset ),  hashsize ( 0 ), duplicatesFound ( 0 ), numDeduplicated ( 0 ), numDeltaRemoved ( 0 ), numReplaced ( 0 ), numMapsShared ( 0 ), lastWins ( false ), clusterLayout ( false ), writer ( nullptr ), wadGameType ( G_UNKNOWN ), hasherInitialised ( false )
+{
+    groupEndOffsets.resize ( numGroupTypes );
+    this->loadBuffer ( buffer, size );
+}
+
+Wadlumpdata Wad::operator[] ( int entrynum )
 {
     if ( sorted == false ) {
         this->updateIndexes ();
@@ -134,9 +224,80 @@ Wadlumpdata & Wad::operator[] ( int entrynum )
         throw std::out_of_range ( "" );
     }
 
-    std::vector < Wadlumpdata >::iterator it = wadlump.begin ();
-    std::advance ( it, entrynum );
-    return *it;
+    return getEntry ( entrynum );
+}
+
+Wadlumpdata Wad::getEntry ( int index ) const
+{
+    Wadlumpdata entry;
+
+    entry.name = names[index];
+    entry.lumpsize = sizes[index];
+    entry.setLocation ( locations[index] );
+    entry.type = types[index];
+    entry.fingerprint = fingerprints[index];
+    entry.deduped = ( dedupOf[index] >= 0 );
+    entry.packedsize = packedSizes[index];
+    entry.lumpdata = lumpdata[index];
+    return entry;
+}
+
+void Wad::setEntry ( int index, const Wadlumpdata& entry )
+{
+    // Overwrites the entry at 'index'.  Any deduplication of it is undone.
+    names[index] = entry.name;
+    sizes[index] = entry.lumpsize;
+    locations[index] = entry.getLocation();
+    types[index] = entry.type;
+    fingerprints[index] = entry.fingerprint;
+    dedupOf[index] = -1;
+    packedSizes[index] = entry.packedsize;
+    lumpdata[index] = entry.lumpdata;
+}
+
+void Wad::insertEntry ( int index, const Wadlumpdata& entry )
+{
+    // Inserts an entry before 'index'.  Anything which refers to an entry after it by position
+    // has to be moved up.
+    names.insert ( names.begin() + index, entry.name );
+    sizes.insert ( sizes.begin() + index, entry.lumpsize );
+    locations.insert ( locations.begin() + index, entry.getLocation() );
+    types.insert ( types.begin() + index, entry.type );
+    fingerprints.insert ( fingerprints.begin() + index, entry.fingerprint );
+    dedupOf.insert ( dedupOf.begin() + index, -1 );
+    packedSizes.insert ( packedSizes.begin() + index, entry.packedsize );
+    lumpdata.insert ( lumpdata.begin() + index, entry.lumpdata );
+
+    if ( index + 1 < static_cast<int> ( names.size() ) ) {
+        // Not appended at the end, so other entries have moved.
+        for ( std::vector< int >::iterator it = dedupOf.begin(); it != dedupOf.end(); ++it ) {
+            if ( *it >= index ) {
+                ++*it;
+            }
+        }
+    }
+    numlumps = names.size();
+}
+
+void Wad::eraseEntries ( int index, int count )
+{
+    names.erase ( names.begin() + index, names.begin() + index + count );
+    sizes.erase ( sizes.begin() + index, sizes.begin() + index + count );
+    locations.erase ( locations.begin() + index, locations.begin() + index + count );
+    types.erase ( types.begin() + index, types.begin() + index + count );
+    fingerprints.erase ( fingerprints.begin() + index, fingerprints.begin() + index + count );
+    dedupOf.erase ( dedupOf.begin() + index, dedupOf.begin() + index + count );
+    packedSizes.erase ( packedSizes.begin() + index, packedSizes.begin() + index + count );
+    lumpdata.erase ( lumpdata.begin() + index, lumpdata.begin() + index + count );
+
+    for ( std::vector< int >::iterator it = dedupOf.begin(); it != dedupOf.end(); ++it ) {
+        if ( *it >= index + count ) {
+            *it -= count;
+        } else if ( *it >= index ) {
+            *it = -1; // The entry it shared data with has gone, but it still holds the data itself.
+        }
+    }
+    numlumps = names.size();
 }
 
 gameTypes Wad::getGameType()
@@ -152,34 +313,72 @@ gameTypes Wad::getGameType()
 int Wad::deduplicate ()
 {
   //  This searches for any future entries which have the same data.
-  // If the data is the same, we set the pointer to the first entries data, and set the location to be
-  // a pointer to the first entry.
-  // Deduped entries will then always refer to the original entry when queried for information.
-  
-  // This only handles deduplicating TWO entries where the data is the same as the second has to point to a first
-  // which has original information.  We can't handle a deduplicated entry pointing to a deduplicated one and
-  // I won't bother doing this as its unlikely to be an issue.
+  // If the data is the same, the later entry shares the first entry's data, and records which
+  // entry it shares it with, so that it can be given the same location.
+  // Entries are bucketed by fingerprint, so only those which probably match are compared.
+
+    std::unordered_map< uint64_t, std::vector< int > > buckets;
 
     if ( !sorted ) {
         updateIndexes();
     }
 
-    std::vector < Wadlumpdata >::iterator index;
+    TRACE_SCOPE ( "deduplicate" );
+
+    // Whole maps first.  A map which is the same as an earlier one, even under another name, shares
+    // the data of all its lumps with it.  One comparison of the map fingerprints finds them.
+    std::unordered_map< uint64_t, int > maps;
+
+    for ( int index = 0; index < static_cast<int> ( numlumps ); ++index ) {
+        int length = mapBlockLength ( index );
+
+        if ( length == 0 ) {
+            continue;
+        }
+
+        std::pair< std::unordered_map< uint64_t, int >::iterator, bool > first = maps.insert ( std::make_pair ( mapFingerprint ( index ), index ) );
 
-    for ( std::vector < Wadlumpdata >::iterator it = wadlump.begin (); it != wadlump.end (); it++ ) {
-        for ( index = std::next ( it ); index != wadlump.end (); index++ ) {
-            if ( ( index->lumpsize > 0 ) && ( index->lumpsize == it->lumpsize ) && ( index->deduped == false ) && ( it->deduped == false ) ) {
+        if ( !first.second && sameMapData ( first.first->second, index, length ) ) {
+            for ( int z = 0; z <= length; ++z ) {
+                int owner = first.first->second + z;
 
-                if ( std::memcmp ( index->lumpdata.get(), it->lumpdata.get(), it->lumpsize ) == 0 ) {
-                    index->lumpdata = it->lumpdata;
-                    index->setLocation( &(*it) ); // We refer to the location by pointing to the original entry.
-                    //  That way, if the original entry changes position, we always refer to the right one.
-                    index->deduped = true;
+                if ( dedupOf[owner] >= 0 ) {
+                    owner = dedupOf[owner];
+                }
+                if ( ( sizes[index + z] > 0 ) && ( dedupOf[index + z] < 0 ) ) {
+                    lumpdata[index + z] = lumpdata[owner];
+                    packedSizes[index + z] = packedSizes[owner];
+                    dedupOf[index + z] = owner;
                     ++numDeduplicated;
                 }
             }
+            ++numMapsShared;
+        }
+        index += length;
+    }
+
+    for ( int index = 0; index < static_cast<int> ( numlumps ); ++index ) {
+        if ( ( sizes[index] <= 0 ) || ( dedupOf[index] >= 0 ) ) {
+            continue;
+        }
+
+        std::vector< int > &candidates = buckets[fingerprints[index]];
+        std::vector< int >::const_iterator it;
+
+        for ( it = candidates.begin(); it != candidates.end(); ++it ) {
+            if ( sameData ( *it, index ) ) {
+                break;
+            }
         }
 
+        if ( it != candidates.end() ) {
+            lumpdata[index] = lumpdata[*it];
+            packedSizes[index] = packedSizes[*it];
+            dedupOf[index] = *it;
+            ++numDeduplicated;
+        } else {
+            candidates.push_back ( index );
+        }
     }
     // If we have deduplicated any, we will need to redo the indexes again before saving, otherwise
     // we are OK to go.
@@ -193,13 +392,299 @@ int Wad::deduplicate ()
 }
 
 
+static bool isDirectory ( const char *path )
+{
+    struct stat info;
+    return ( stat ( path, &info ) == 0 ) && ( ( info.st_mode & S_IFMT ) == S_IFDIR );
+}
+
+static bool isMapLump ( const std::array<char, 8> &name )
+{
+    // True if the name is one of the lumps which make up a map, following the map marker.
+    for ( int z = 0; z <= mapEntries; ++z ) {
+        if ( std::strncmp ( name.data(), maplumpnames[z], lumpNameLength ) == 0 ) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool isUncheckedMapLump ( const std::array<char, 8> &name )
+{
+    // Entries which make up a map aren't checked for duplicates, as every map has them.
+    // This matches by prefix, as merging always has.
+    for ( int z = 0; z <= ( mapEntries - 1 ); ++z ) {
+        if ( std::equal ( name.begin(), name.begin() + strlen ( maplumpnames[z] ), maplumpnames[z] ) ) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool isNamespaceMarker ( const std::array<char, 8> &name, int size, const char *suffix )
+{
+    // True for empty lumps such as S_START, FF_END, etc.
+    size_t len = strnlen ( name.data(), lumpNameLength );
+    size_t suffixlen = std::strlen ( suffix );
+
+    return ( size == 0 ) && ( len > suffixlen ) && ( std::strncmp ( name.data() + len - suffixlen, suffix, suffixlen ) == 0 );
+}
+
+static std::string lumpName ( const std::array<char, 8> &name )
+{
+    return std::string ( name.data(), strnlen ( name.data(), lumpNameLength ) );
+}
+
+int Wad::mapBlockLength ( int index ) const
+{
+    // If the entry at 'index' is a map marker, returns the number of map lumps which follow it.
+    // Otherwise returns zero.
+    int count = 0;
+
+    if ( isMapLump ( names[index] ) ) {
+        return 0;
+    }
+
+    while ( ( index + count + 1 < static_cast<int> ( names.size() ) ) && isMapLump ( names[index + count + 1] ) ) {
+        ++count;
+    }
+    return count;
+}
+
+uint64_t Wad::mapFingerprint ( int index ) const
+{
+    // Combines the fingerprints of the map at 'index' into one.  The names and data of its lumps
+    // are included, but not the name of the map, so the same map under another name matches.
+    std::vector< char > combined;
+    int length = mapBlockLength ( index );
+
+    for ( int z = 0; z <= length; ++z ) {
+        const char *fp = reinterpret_cast<const char *> ( &fingerprints[index + z] );
+        if ( z > 0 ) {
+            combined.insert ( combined.end(), names[index + z].begin(), names[index + z].end() );
+        }
+        combined.insert ( combined.end(), fp, fp + sizeof ( uint64_t ) );
+    }
+    return fingerprint ( combined.data(), combined.size() );
+}
+
+void Wad::calcMapFingerprints()
+{
+    mapFingerprints.clear();
+    for ( int x = 0; x < static_cast<int> ( names.size() ); ++x ) {
+        int length = mapBlockLength ( x );
+        if ( length > 0 ) {
+            mapFingerprints[x] = mapFingerprint ( x );
+            x += length;
+        }
+    }
+}
+
+void Wad::noteMap ( const Wad& wad, int source, bool stored )
+{
+    // Keeps track of the maps merged in.  If the map at 'source' in 'wad' is being dropped because
+    // one of the same name was merged first, but the two differ, it is reported as a conflict.
+    std::unordered_map< int, uint64_t >::const_iterator fp = wad.mapFingerprints.find ( source );
+
+    if ( fp == wad.mapFingerprints.end() ) {
+        return;
+    }
+
+    std::string name = lumpName ( wad.names[source] );
+
+    if ( stored ) {
+        mergedMaps.insert ( std::make_pair ( name, fp->second ) );
+    } else {
+        std::unordered_map< std::string, uint64_t >::const_iterator kept = mergedMaps.find ( name );
+        if ( ( kept != mergedMaps.end() ) && ( kept->second != fp->second ) ) {
+            TRACE_INSTANT ( "map conflict", name );
+            mapConflicts.push_back ( name );
+        }
+    }
+}
+
+bool Wad::sameMapData ( int first, int second, int length ) const
+{
+    // The fingerprints matched, but make sure before sharing the data.
+    if ( mapBlockLength ( first ) != length ) {
+        return false;
+    }
+    for ( int z = 0; z <= length; ++z ) {
+        if ( !sameData ( first + z, second + z ) ) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Wad::sameData ( int first, int second ) const
+{
+    if ( sizes[first] != sizes[second] ) {
+        return false;
+    }
+    if ( packedSizes[first] == packedSizes[second] ) {
+        // Both compressed, or both not.  The same data always compresses to the same bytes, so
+        // there's no need to expand it to compare.
+        return std::memcmp ( lumpdata[first].get(), lumpdata[second].get(), packedSizes[first] ? packedSizes[first] : sizes[first] ) == 0;
+    }
+    if ( packedSizes[first] && packedSizes[second] ) {
+        return false;
+    }
+    return std::memcmp ( unpackedData ( first ).get(), unpackedData ( second ).get(), sizes[first] ) == 0;
+}
+
+static std::shared_ptr<char> unpack ( const std::shared_ptr<char>& data, int packedsize, int size )
+{
+    // Compressed lump data is only expanded for as long as it is being used.
+    if ( packedsize == 0 ) {
+        return data;
+    }
+
+    std::shared_ptr<char> unpacked = make_shared_array<char> ( size );
+    if ( !lzDecompress ( data.get(), packedsize, unpacked.get(), size ) ) {
+        throw ( std::string ( "Error decompressing lump." ) );
+    }
+    return unpacked;
+}
+
+std::shared_ptr<char> Wad::unpackedData ( int index ) const
+{
+    return unpack ( lumpdata[index], packedSizes[index], sizes[index] );
+}
+
+void Wad::compress()
+{
+    // Keeps the lump data compressed in memory, to be expanded only when it is written out or
+    // compared.  All of it is moved into a new block, so the block it was loaded into is freed,
+    // even though lumps which are small or don't compress are kept as they are.  The fingerprints
+    // were taken from the uncompressed data, so they stay the same.
+    TRACE_SCOPE ( "compress" );
+    std::shared_ptr< std::vector<char> > store = std::make_shared< std::vector<char> > ();
+    std::vector< int > offsets ( names.size(), 0 );
+    std::vector<char> scratch;
+
+    for ( unsigned int x = 0; x < names.size(); ++x ) {
+        if ( dedupOf[x] >= 0 ) {
+            continue;
+        }
+
+        offsets[x] = store->size();
+        int packed = 0;
+
+        if ( ( packedSizes[x] == 0 ) && ( sizes[x] >= minPackSize ) ) {
+            // Only worth keeping compressed if it saves at least an eighth.
+            scratch.resize ( sizes[x] );
+            packed = lzCompress ( lumpdata[x].get(), sizes[x], scratch.data(), sizes[x] - sizes[x] / 8 );
+        }
+        if ( packed > 0 ) {
+            store->insert ( store->end(), scratch.begin(), scratch.begin() + packed );
+            packedSizes[x] = packed;
+        } else {
+            int length = packedSizes[x] ? packedSizes[x] : sizes[x];
+            store->insert ( store->end(), lumpdata[x].get(), lumpdata[x].get() + length );
+        }
+    }
+    store->shrink_to_fit();
+
+    for ( unsigned int x = 0; x < names.size(); ++x ) {
+        int from = ( dedupOf[x] >= 0 ) ? dedupOf[x] : x;
+        lumpdata[x] = std::shared_ptr<char> ( store, store->data() + offsets[from] );
+        packedSizes[x] = packedSizes[from];
+    }
+}
+
+int Wad::deltaAgainst ( const Wad& base )
+{
+    // Removes every lump which the base wad already has with the same name and data, so that what is
+    // left is a PWAD which can be loaded on top of the base.  Lump data is compared by fingerprint.
+    // Maps are kept or removed as a whole, and namespace markers (S_START/S_END etc.) are only kept
+    // if something is left between them.
+    std::unordered_map< std::string, int > baseLumps;
+    std::vector< int > kept; // Positions of the entries we keep, in order.
+    std::vector< int > openMarkers; // Positions in 'kept' of the START markers we are inside.
+    TRACE_SCOPE ( "delta against base" );
+
+    for ( int x = static_cast<int> ( base.names.size() ) - 1; x >= 0; --x ) {
+        if ( !isMapLump ( base.names[x] ) ) {
+            baseLumps[lumpName ( base.names[x] )] = x; // Loop runs backwards, so the first one is kept.
+        }
+    }
+
+    kept.reserve ( numlumps );
+
+    for ( int x = 0; x < static_cast<int> ( numlumps ); ++x ) {
+        std::unordered_map< std::string, int >::const_iterator found = baseLumps.find ( lumpName ( names[x] ) );
+        int maplength = mapBlockLength ( x );
+
+        if ( isNamespaceMarker ( names[x], sizes[x], "_START" ) && ( maplength == 0 ) ) {
+            openMarkers.push_back ( kept.size() );
+            kept.push_back ( x );
+            continue;
+        }
+
+        if ( isNamespaceMarker ( names[x], sizes[x], "_END" ) && !openMarkers.empty() ) {
+            if ( openMarkers.back() == static_cast<int> ( kept.size() ) - 1 ) {
+                kept.pop_back(); // Nothing was kept inside this namespace, so drop both markers.
+            } else {
+                kept.push_back ( x );
+            }
+            openMarkers.pop_back();
+            continue;
+        }
+
+        bool changed = ( found == baseLumps.end() );
+
+        if ( !changed ) {
+            int b = found->second;
+            changed = ( base.sizes[b] != sizes[x] ) || ( base.fingerprints[b] != fingerprints[x] );
+
+            if ( !changed && ( maplength != base.mapBlockLength ( b ) ) ) {
+                changed = true;
+            }
+            for ( int z = 1; ( z <= maplength ) && !changed; ++z ) {
+                changed = ( names[x + z] != base.names[b + z] ) || ( sizes[x + z] != base.sizes[b + z] ) || ( fingerprints[x + z] != base.fingerprints[b + z] );
+            }
+        }
+
+        if ( changed ) {
+            for ( int z = 0; z <= maplength; ++z ) {
+                kept.push_back ( x + z );
+            }
+        }
+        x += maplength;
+    }
+
+    int removed = numlumps - kept.size();
+
+    // Move the kept entries down over the removed ones.  'kept' is in order, so nothing is
+    // overwritten before it has been moved.
+    for ( int x = 0; x < static_cast<int> ( kept.size() ); ++x ) {
+        int from = kept[x];
+        names[x] = names[from];
+        sizes[x] = sizes[from];
+        locations[x] = locations[from];
+        types[x] = types[from];
+        fingerprints[x] = fingerprints[from];
+        dedupOf[x] = -1;
+        packedSizes[x] = packedSizes[from];
+        lumpdata[x] = lumpdata[from];
+    }
+    eraseEntries ( kept.size(), removed );
+
+    numDeltaRemoved += removed;
+    calcLabelOffsets();
+    sorted = false;
+    return removed;
+}
+
 unsigned int Wad::getNumLumps ( void ) const
 {
-    return wadlump.size();
+    return names.size();
 }
 
 int Wad::mergeWad ( Wad& wad, bool allowDuplicates )
 {
+    TRACE_SCOPE ( "merge" );
 
     if ( ( hashsize != 0 ) && ( hasherInitialised == false ) ) {
         hasher.resize ( hashsize );
@@ -207,28 +692,192 @@ int Wad::mergeWad ( Wad& wad, bool allowDuplicates )
     }
 
     for ( int x = 0; x < wad.getNumLumps(); ++x ) {
-        bool dup = this->storeEntry ( wad[x], allowDuplicates );
-        if ( dup == true ) {
-            // If it's a map, skip the next 10 lumps, as they are duplicates too.
-            if ( ( ( wad[x] ).lumpsize <= 16 ) && std::equal ( ( wad[x] ).name.begin(), ( wad[x] ).name.begin() + 3, "MAP" ) ) {
-                x += wad.wadGameType;
-            
-            // wadGameType enum = 10 for doom2 and 11 for hexen, which coincides with the number
-            // of entries we have to skip to get to the next map.  We of course, use the wadtype of the
-            // wad we are merging, not THIS one.
-            } else if ( ( ( wad[x] ).lumpsize <= 16 ) && ( ( wad[x] ).name[0] == 'E' ) && ( ( wad[x] ).name[2] == 'M' ) ) {
-                x += mapEntries;
-                duplicatesFound += ( mapEntries + 1 );
-            } else if ( std::equal ( ( wad[x] ).name.begin(), ( wad[x] ).name.begin() + 6, "GL_MAP" ) ) { 
-                x += glMapEntries;
-            } else if ( std::equal ( ( wad[x] ).name.begin(), ( wad[x] ).name.begin() + 4, "GL_E" ) && ( ( wad[x] ).name[5] == 'M' ) )  {
-                x += glMapEntries;
-            } else {
-                ++duplicatesFound;
+        bool dup = this->storeEntry ( wad.getEntry ( x ), allowDuplicates );
+        const std::array<char, 8> &name = wad.names[x];
+
+        if ( ( dup == true ) && lastWins ) {
+            // The entry has been replaced.  If it's a map marker, the whole map is replaced with it.
+            int maplength = wad.mapBlockLength ( x );
+            if ( maplength ) {
+                replaceMap ( lumpIndex[lumpName ( name )], wad, x );
+                mergedMaps[lumpName ( name )] = wad.mapFingerprints[x];
+                numReplaced += maplength;
+                x += maplength;
+            }
+        } else if ( dup == true ) {
+            noteMap ( wad, x, false );
+            x += wad.duplicateSpan ( x, duplicatesFound );
+        } else {
+            noteMap ( wad, x, true );
+        }
+    }
+
+    return 0;
+}
+
+int Wad::duplicateSpan ( int x, int& discarded ) const
+{
+    // The entry at 'x' was a duplicate.  Returns how many of the entries after it are skipped along with it,
+    // and adds to 'discarded' the number of entries to report as discarded.
+    const std::array<char, 8> &name = names[x];
+
+    // If it's a map, skip the next 10 lumps, as they are duplicates too.
+    if ( ( sizes[x] <= 16 ) && std::equal ( name.begin(), name.begin() + 3, "MAP" ) ) {
+        TRACE_INSTANT ( "map skipped", lumpName ( name ) );
+        return wadGameType;
+
+    // wadGameType enum = 10 for doom2 and 11 for hexen, which coincides with the number
+    // of entries we have to skip to get to the next map.  We of course, use the wadtype of the
+    // wad we are merging, not THIS one.
+    } else if ( ( sizes[x] <= 16 ) && ( name[0] == 'E' ) && ( name[2] == 'M' ) ) {
+        TRACE_INSTANT ( "map skipped", lumpName ( name ) );
+        discarded += ( mapEntries + 1 );
+        return mapEntries;
+    } else if ( std::equal ( name.begin(), name.begin() + 6, "GL_MAP" ) ) {
+        TRACE_INSTANT ( "map skipped", lumpName ( name ) );
+        return glMapEntries;
+    } else if ( std::equal ( name.begin(), name.begin() + 4, "GL_E" ) && ( name[5] == 'M' ) )  {
+        TRACE_INSTANT ( "map skipped", lumpName ( name ) );
+        return glMapEntries;
+    }
+    TRACE_INSTANT ( "duplicate dropped", lumpName ( name ) );
+    ++discarded;
+    return 0;
+}
+
+template < typename Work >
+static bool runWorkers ( unsigned int threads, Work work )
+{
+    // Runs work(t) for each t below 'threads', each on its own thread, and waits for them all.
+    // Returns false, having waited for those which did start, if the threads couldn't be created.
+    std::vector< std::thread > workers;
+    bool started = true;
+
+    try {
+        for ( unsigned int t = 0; t < threads; ++t ) {
+            workers.push_back ( std::thread ( work, t ) );
+        }
+    } catch ( std::system_error &e ) {
+        started = false;
+    }
+    for ( std::vector< std::thread >::iterator it = workers.begin(); it != workers.end(); ++it ) {
+        it->join();
+    }
+    return started;
+}
+
+int Wad::mergeWads ( std::vector< Wad >& wads, bool allowDuplicates, unsigned int threads )
+{
+    // Merges all of 'wads', in order, giving exactly what calling mergeWad on each would.
+    // Lumps are split between 'threads' workers by the hash of their name.  Each worker finds the
+    // duplicates among the names in its share, going through the wads in order so the first one
+    // wins.  The lumps which weren't duplicates are then stored in their original order.
+    // If the threads can't be started, the wads are merged one at a time instead.
+    size_t lumpCount = names.size();
+    for ( std::vector< Wad >::const_iterator it = wads.begin(); it != wads.end(); ++it ) {
+        lumpCount += it->names.size();
+    }
+    threads = std::min ( threads, std::max ( 1u, std::thread::hardware_concurrency() ) * mergeThreadsPerCore );
+    threads = static_cast<unsigned int> ( std::min<size_t> ( threads, lumpCount ) );
+
+    auto mergeSerially = [&] () {
+        for ( std::vector< Wad >::iterator it = wads.begin(); it != wads.end(); ++it ) {
+            mergeWad ( *it, allowDuplicates );
+        }
+        return 0;
+    };
+
+    if ( allowDuplicates || lastWins || writer || ( threads <= 1 ) ) {
+        return mergeSerially();
+    }
+
+    TRACE_SCOPE ( "parallel merge" );
+
+    if ( ( hashsize != 0 ) && ( hasherInitialised == false ) ) {
+        hasher.resize ( hashsize );
+        hasherInitialised = true;
+    }
+
+    // partitions[wad][worker] lists the entries of that wad which the worker checks.
+    std::vector< std::vector< std::vector< int > > > partitions ( wads.size(), std::vector< std::vector< int > > ( threads ) );
+    std::vector< std::vector< char > > duplicate ( wads.size() );
+
+    bool started = runWorkers ( threads, [&] ( unsigned int t ) {
+        TRACE_SCOPE ( "partition" );
+        for ( unsigned int w = t; w < wads.size(); w += threads ) {
+            duplicate[w].assign ( wads[w].names.size(), 0 );
+            for ( unsigned int x = 0; x < wads[w].names.size(); ++x ) {
+                if ( !isUncheckedMapLump ( wads[w].names[x] ) ) {
+                    partitions[w][hash ( wads[w].names[x].data() ) % threads].push_back ( x );
+                }
+            }
+        }
+    } );
+
+    started = started && runWorkers ( threads, [&] ( unsigned int t ) {
+        std::unordered_set< uint64_t > seen;
+        uint64_t key;
+        TRACE_SCOPE ( "find duplicates" );
+
+        for ( unsigned int x = 0; x < names.size(); ++x ) {
+            // Anything already in this wad comes first.
+            if ( hash ( names[x].data() ) % threads == t ) {
+                std::memcpy ( &key, names[x].data(), sizeof ( key ) );
+                seen.insert ( key );
+            }
+        }
+        for ( unsigned int w = 0; w < wads.size(); ++w ) {
+            for ( std::vector< int >::const_iterator x = partitions[w][t].begin(); x != partitions[w][t].end(); ++x ) {
+                std::memcpy ( &key, wads[w].names[*x].data(), sizeof ( key ) );
+                duplicate[w][*x] = !seen.insert ( key ).second;
+            }
+        }
+    } );
+
+    if ( !started ) {
+        return mergeSerially();
+    }
+
+    // Work out which entries are stored, skipping the rest of a map when its marker is a duplicate.
+    // The workers didn't know about those skips, so if a skipped entry was taken as the first of its
+    // name, a later one would wrongly have been called a duplicate.  That's unlikely, and if it happens
+    // we simply merge one wad at a time instead.
+    std::vector< std::pair< int, int > > accepted;
+    std::unordered_map< std::string, uint64_t > mergedBefore = mergedMaps;
+    std::vector< std::string >::size_type conflictsBefore = mapConflicts.size();
+    int discarded = 0;
+    TRACE_SCOPE ( "stitch" );
+
+    for ( unsigned int w = 0; w < wads.size(); ++w ) {
+        for ( int x = 0; x < static_cast<int> ( wads[w].names.size() ); ++x ) {
+            noteMap ( wads[w], x, !duplicate[w][x] );
+            if ( !duplicate[w][x] ) {
+                accepted.push_back ( std::make_pair ( w, x ) );
+                continue;
+            }
+            int span = wads[w].duplicateSpan ( x, discarded );
+            for ( int y = x + 1; ( y <= x + span ) && ( y < static_cast<int> ( wads[w].names.size() ) ); ++y ) {
+                if ( !duplicate[w][y] && !isUncheckedMapLump ( wads[w].names[y] ) ) {
+                    TRACE_INSTANT ( "serial merge fallback", lumpName ( wads[w].names[y] ) );
+                    mergedMaps = mergedBefore;
+                    mapConflicts.resize ( conflictsBefore );
+                    return mergeSerially();
+                }
             }
+            x += span;
         }
     }
 
+    for ( std::vector< std::pair< int, int > >::const_iterator it = accepted.begin(); it != accepted.end(); ++it ) {
+        const Wad &wad = wads[it->first];
+        bool ismap = isUncheckedMapLump ( wad.names[it->second] );
+
+        if ( !ismap && ( hashsize != 0 ) ) {
+            hasher[hash ( wad.names[it->second].data() ) % hashsize] = 1;
+        }
+        placeEntry ( wad.getEntry ( it->second ), ismap );
+    }
+    duplicatesFound += discarded;
     return 0;
 }
 
@@ -236,12 +885,12 @@ gameTypes Wad::determineWadGameType ()
 {
     // We need this to know the map format.
 
-    for ( std::vector < Wadlumpdata >::const_iterator it_lump = wadlump.begin(); it_lump != wadlump.end(); ++it_lump ) {
-        if ( it_lump->lumpsize <= 32 ) {
-            if ( ( wadGameType == G_UNKNOWN ) && ( it_lump->lumpsize < 32 ) && ( std::equal ( it_lump->name.begin(), it_lump->name.begin() +3 , "MAP" )  ) )
+    for ( int x = 0; x < static_cast<int> ( names.size() ); ++x ) {
+        if ( sizes[x] <= 32 ) {
+            if ( ( wadGameType == G_UNKNOWN ) && ( sizes[x] < 32 ) && ( std::equal ( names[x].begin(), names[x].begin() +3 , "MAP" )  ) )
 
             {
-                if ( std::equal ( ( it_lump + G_HEXEN )->name.begin(), ( it_lump + G_HEXEN )->name.end(), maplumpnames[10] ) ) {
+                if ( ( x + G_HEXEN < static_cast<int> ( names.size() ) ) && std::equal ( names[x + G_HEXEN].begin(), names[x + G_HEXEN].end(), maplumpnames[10] ) ) {
 
                     // maplumpnames[10] = BEHAVIOR
                     // As this only appears in HEXEN, if the 10th one after the MAP entry is BEHAVIOR
@@ -252,7 +901,7 @@ gameTypes Wad::determineWadGameType ()
                     wadGameType = G_DOOM2;
                     break;
                 }
-            } else if ( ( wadGameType == G_UNKNOWN ) && ( it_lump->lumpsize < 32 ) && ( it_lump->name[0] == 'E' ) && ( it_lump->name[2] == 'M' ) ) {
+            } else if ( ( wadGameType == G_UNKNOWN ) && ( sizes[x] < 32 ) && ( names[x][0] == 'E' ) && ( names[x][2] == 'M' ) ) {
                 // This also applies to HERETIC and Ultimate Doom
                 wadGameType = G_DOOM;
                 break;
@@ -271,18 +920,28 @@ bool Wad::storeEntry ( const Wadlumpdata& entry, bool allowDuplicates )
     bool duplicate = false;
     int hashValue;
     bool collision = false;
-    std::vector< Wadlumpdata >::iterator it;
 
-    if ( allowDuplicates == false )
+    ismap = isUncheckedMapLump ( entry.name ); // It's part of a map.  We don't check these for duplicates.
+
+    if ( lastWins && ( allowDuplicates == false ) ) {
+        // The later entry wins.  If we already have one, overwrite its data where it stands, so it
+        // keeps its position in the directory.
+        std::unordered_map< std::string, int >::const_iterator found;
+
+        if ( ( ismap == false ) && ( ( found = lumpIndex.find ( lumpName ( entry.name ) ) ) != lumpIndex.end() ) ) {
+            int existing = found->second;
+            sizes[existing] = entry.lumpsize;
+            lumpdata[existing] = entry.lumpdata;
+            fingerprints[existing] = entry.fingerprint;
+            dedupOf[existing] = -1;
+            packedSizes[existing] = entry.packedsize;
+            ++numReplaced;
+            sorted = false;
+            return true;
+        }
+    } else if ( allowDuplicates == false )
         // If no duplicates, check and return we've found one, if it is indeed one
     {
-
-        for ( int z = 0; z <= ( mapEntries - 1 ); ++z ) {
-            if ( std::equal ( entry.name.begin(), entry.name.begin() + strlen ( maplumpnames[z] ), maplumpnames[z] ) ) {
-                ismap = true;
-            }
-        } // It's part of a map.  We don't check these for duplicates.
-
         if ( ( ismap == false ) && ( hashsize != 0 ) ) {
             // So its not part of a map.  Have we come accross this entryname before?
             // We can do a quick hash search, IF the hashtable has been initialised.
@@ -298,36 +957,15 @@ bool Wad::storeEntry ( const Wadlumpdata& entry, bool allowDuplicates )
         if ( ( collision == true ) || ( hashsize == 0 ) ) {
             // If its a collision, or we haven't initialised the hash table, do a slow search.
 
-            for ( it = wadlump.begin(); it != wadlump.end(); ++it ) {
-                if ( ( std::equal ( entry.name.begin(), entry.name.end(), it->name.begin() ) ) && ( ismap == false ) ) {
-                    duplicate = true;    // So we've determined its a duplicate, for real..
-                }
-            } // End for loop.
+            if ( ( ismap == false ) && ( std::find ( names.begin(), names.end(), entry.name ) != names.end() ) ) {
+                duplicate = true;    // So we've determined its a duplicate, for real..
+            }
         }
     } // end if (allowDuplicates == false)
 
     if ( !duplicate || ( allowDuplicates == true ) ) {
         // If not a duplicate, we can add it, OR if we've allowed them
-        if ( ( entry.type != T_GENERAL ) && ( groupEndOffsets[entry.type] != 0 ) ) {
-            it = wadlump.begin();
-            std::advance ( it, groupEndOffsets[entry.type] ); // Jump to the end of the segment.
-
-            wadlump.insert ( it, entry ); // Insert.
-            groupEndOffsets[entry.type]++; // Move end of segment up one space, as we've
-            // inserted an entry before it.
-
-            for ( int x = 0; x < numGroupTypes; ++x ) {
-                // All end of segment marker entries  this, also get moved up one space .
-                if ( groupEndOffsets[x] > groupEndOffsets[entry.type] ) {
-                    groupEndOffsets[x]++;
-                }
-                // Because these are kept up to date, we don't need to recalculate the offsets
-                // for the next merge.
-            }
-        } else {
-            wadlump.push_back ( entry );    // Otherwise, we just append it.
-        }
-        sorted = false;
+        placeEntry ( entry, ismap );
     }
 
     return duplicate;  // The calling function might want to know whether this was
@@ -335,36 +973,269 @@ bool Wad::storeEntry ( const Wadlumpdata& entry, bool allowDuplicates )
 }
 
 
-Wad::~Wad()
-{
-
-}
-
-int Wad::updateIndexes()
+void Wad::placeEntry ( const Wadlumpdata& entry, bool ismap )
 {
-    std::vector < Wadlumpdata >::iterator it;
+    // Adds an entry which has been accepted, at the end of its group if it belongs to one.
+    Wadlumpdata stored = entry;
 
-    numlumps = wadlump.size();
-    dirloc = wadLumpBeginOffset; // We start after the WAD header.
+    if ( writer ) {
+        // Streaming the output, so the data goes out now.
+        stored.setLocation ( writer->append ( unpack ( stored.lumpdata, stored.packedsize, stored.lumpsize ), stored.lumpsize ) );
+    }
 
-    std::for_each ( wadlump.begin(), wadlump.end(), [&] ( Wadlumpdata &x ) {
-        if ( x.deduped == false ) {
-            x.setLocation ( dirloc );
-            dirloc += x.lumpsize;
+    if ( ( entry.type != T_GENERAL ) && ( groupEndOffsets[entry.type] != 0 ) ) {
+        insertEntry ( groupEndOffsets[entry.type], stored ); // Insert at the end of the segment.
+        if ( lastWins && ( ismap == false ) ) {
+            shiftLumpIndex ( groupEndOffsets[entry.type], 1 );
+            lumpIndex.insert ( std::make_pair ( lumpName ( entry.name ), groupEndOffsets[entry.type] ) );
         }
-    } );
+        groupEndOffsets[entry.type]++; // Move end of segment up one space, as we've
+        // inserted an entry before it.
 
-    return dirloc;
+        for ( int x = 0; x < numGroupTypes; ++x ) {
+            // All end of segment marker entries  this, also get moved up one space .
+            if ( groupEndOffsets[x] > groupEndOffsets[entry.type] ) {
+                groupEndOffsets[x]++;
+            }
+            // Because these are kept up to date, we don't need to recalculate the offsets
+            // for the next merge.
+        }
+    } else {
+        insertEntry ( names.size(), stored );    // Otherwise, we just append it.
+        if ( lastWins && ( ismap == false ) ) {
+            lumpIndex.insert ( std::make_pair ( lumpName ( entry.name ), static_cast<int> ( names.size() ) - 1 ) );
+        }
+    }
+    sorted = false;
 }
 
-int Wad::save ( const char *filename )
+void Wad::shiftLumpIndex ( int from, int amount )
 {
-    std::vector< Wadlumpdata >::iterator it;
-    std::ofstream fout;
-    fout.exceptions ( std::ifstream::failbit | std::ifstream::badbit );
+    // Entries at or after 'from' have moved by 'amount' places.
+    for ( std::unordered_map< std::string, int >::iterator it = lumpIndex.begin(); it != lumpIndex.end(); ++it ) {
+        if ( it->second >= from ) {
+            it->second += amount;
+        }
+    }
+}
 
-    try {
-        fout.open ( filename, std::ios_base::binary );
+void Wad::replaceMap ( int index, const Wad& wad, int source )
+{
+    // Replaces the lumps of the map whose marker is at 'index' with those of the map at 'source' in 'wad'.
+    // The marker itself has already been replaced by storeEntry.
+    int oldlength = mapBlockLength ( index );
+    int newlength = wad.mapBlockLength ( source );
+
+    if ( oldlength == newlength ) {
+        for ( int z = 1; z <= newlength; ++z ) {
+            setEntry ( index + z, wad.getEntry ( source + z ) );
+        }
+    } else {
+        // The maps are made up of a different number of lumps (e.g, one has GL nodes).
+        eraseEntries ( index + 1, oldlength );
+        for ( int z = 1; z <= newlength; ++z ) {
+            insertEntry ( index + z, wad.getEntry ( source + z ) );
+        }
+        shiftLumpIndex ( index + 1, newlength - oldlength );
+
+        for ( int x = 0; x < numGroupTypes; ++x ) {
+            if ( groupEndOffsets[x] > index ) {
+                groupEndOffsets[x] += newlength - oldlength;
+            }
+        }
+    }
+    sorted = false;
+}
+
+Wad::~Wad()
+{
+
+}
+
+static lumpKinds lumpKind ( const std::array<char, 8> &name, lumpTypes type, const char *data, int size )
+{
+    // Works out what a lump holds, from its name, its namespace and the start of its data.
+    static const char *printable = "\t\n\r";
+
+    if ( isMapLump ( name ) ) {
+        return K_MAP;
+    }
+    switch ( type ) {
+    case T_F_START:
+    case T_F1_START:
+    case T_F2_START:
+    case T_F3_START:
+        return K_FLAT;
+    case T_S_START:
+        return K_SPRITE;
+    case T_P_START:
+    case T_P1_START:
+    case T_P2_START:
+        return K_PATCH;
+    case T_C_START:
+        return K_PALETTE;
+    default:
+        break;
+    }
+    if ( ( lumpName ( name ) == "PLAYPAL" ) || ( lumpName ( name ) == "COLORMAP" ) ) {
+        return K_PALETTE;
+    }
+    if ( size >= 4 ) {
+        if ( ( std::memcmp ( data, "MUS\x1a", 4 ) == 0 ) || ( std::memcmp ( data, "MThd", 4 ) == 0 ) || ( std::memcmp ( data, "OggS", 4 ) == 0 ) ) {
+            return K_MUSIC;
+        }
+        if ( ( std::memcmp ( data, "RIFF", 4 ) == 0 ) || ( ( data[0] == 3 ) && ( data[1] == 0 ) ) ) {
+            return K_SOUND; // A wave file, or a Doom format sound.
+        }
+        if ( std::memcmp ( data, "\x89PNG", 4 ) == 0 ) {
+            return K_IMAGE;
+        }
+    }
+
+    // Text, such as MAPINFO or DEHACKED.  Only the start is checked.
+    int x;
+    for ( x = 0; ( x < size ) && ( x < 512 ); ++x ) {
+        unsigned char c = data[x];
+        if ( ( c < ' ' || c > '~' ) && !std::strchr ( printable, c ) ) {
+            break;
+        }
+    }
+    if ( ( size > 0 ) && ( x == std::min ( size, 512 ) ) ) {
+        return K_TEXT;
+    }
+    return K_GENERAL;
+}
+
+std::vector<int> Wad::clusterOrder() const
+{
+    // The order to lay out the lump data in so that it compresses well, with lumps which are
+    // alike next to each other, within reach of the compressor.  Lumps are grouped by kind.  Map
+    // lumps are grouped by what they are (all the THINGS, then all the LINEDEFS, ...), and other
+    // lumps by name, which keeps things like the frames of a sprite together.
+    std::vector<int> order;
+    std::vector<int> kinds ( names.size(), K_GENERAL );
+    std::vector<int> subkinds ( names.size(), 0 );
+
+    for ( unsigned int x = 0; x < names.size(); ++x ) {
+        if ( dedupOf[x] >= 0 ) {
+            continue;
+        }
+        std::shared_ptr<char> data = unpackedData ( x );
+        kinds[x] = lumpKind ( names[x], types[x], data.get(), sizes[x] );
+        if ( kinds[x] == K_MAP ) {
+            while ( ( subkinds[x] < 16 ) && ( lumpName ( names[x] ) != maplumpnames[subkinds[x]] ) ) {
+                ++subkinds[x];
+            }
+        }
+        order.push_back ( x );
+    }
+
+    std::stable_sort ( order.begin(), order.end(), [&] ( int a, int b ) {
+        if ( kinds[a] != kinds[b] ) {
+            return kinds[a] < kinds[b];
+        }
+        if ( subkinds[a] != subkinds[b] ) {
+            return subkinds[a] < subkinds[b];
+        }
+        return ( kinds[a] != K_MAP ) && ( names[a] < names[b] );
+    } );
+    return order;
+}
+
+int64_t Wad::packedEstimate ( const std::vector<int>& order ) const
+{
+    // Roughly how small the lump data would compress, laid out in 'order', using the built in
+    // compressor a block at a time.  Archivers do better, but change by much the same amount
+    // between one layout and another.
+    std::vector<char> block;
+    std::vector<char> packed;
+    int64_t total = 0;
+
+    for ( unsigned int x = 0; x <= order.size(); ++x ) {
+        if ( x < order.size() ) {
+            std::shared_ptr<char> data = unpackedData ( order[x] );
+            block.insert ( block.end(), data.get(), data.get() + sizes[order[x]] );
+        }
+        if ( ( block.size() >= estimateBlockSize ) || ( ( x == order.size() ) && !block.empty() ) ) {
+            packed.resize ( block.size() + block.size() / 255 + 16 );
+            int length = lzCompress ( block.data(), block.size(), packed.data(), packed.size() );
+            total += length ? length : block.size();
+            block.clear();
+        }
+    }
+    return total;
+}
+
+int Wad::updateIndexes()
+{
+    TRACE_SCOPE ( "layout" );
+    numlumps = names.size();
+
+    if ( writer ) {
+        // Locations were fixed when the data was streamed out.
+        dirloc = writer->getOffset();
+        return dirloc;
+    }
+
+    dirloc = wadLumpBeginOffset; // We start after the WAD header.
+
+    if ( clusterLayout ) {
+        // Only where the data goes changes.  The directory stays in the same order.
+        std::vector<int> order = clusterOrder();
+        for ( std::vector<int>::const_iterator it = order.begin(); it != order.end(); ++it ) {
+            locations[*it] = dirloc;
+            dirloc += sizes[*it];
+        }
+    } else {
+        for ( unsigned int x = 0; x < numlumps; ++x ) {
+            if ( dedupOf[x] < 0 ) {
+                locations[x] = dirloc;
+                dirloc += sizes[x];
+            }
+        }
+    }
+
+    // Deduplicated entries go wherever the entry they share data with went.
+    for ( unsigned int x = 0; x < numlumps; ++x ) {
+        if ( dedupOf[x] >= 0 ) {
+            locations[x] = locations[dedupOf[x]];
+        }
+    }
+
+    return dirloc;
+}
+
+void Wad::writeHeader ( std::ostream& fout )
+{
+    int32_t z = names.size ();
+
+    fout.seekp ( 0, std::ios::beg );
+    fout.write ( reinterpret_cast < char *> ( wad_id.data() ), wad_id.size() );
+    fout.write ( reinterpret_cast < char *> ( &z ), sizeof ( int32_t ) ) ;
+    fout.write ( reinterpret_cast < char *> ( &dirloc ), sizeof ( int32_t ) );
+}
+
+void Wad::writeDirectory ( std::ostream& fout )
+{
+    fout.seekp ( dirloc, std::ios::beg );
+
+    for ( unsigned int x = 0; x < names.size(); ++x ) {
+        int32_t loc = locations[x];
+        int32_t size = sizes[x];
+        fout.write ( reinterpret_cast < char *> ( &loc ), sizeof ( int32_t ) ) ;
+        fout.write ( reinterpret_cast < char *> ( &size ), sizeof ( int32_t ) );
+        fout.write ( names[x].data(), lumpNameLength );
+    }
+}
+
+int Wad::save ( const char *filename )
+{
+    std::ofstream fout;
+    TRACE_SCOPE_ARG ( "save", filename );
+    fout.exceptions ( std::ifstream::failbit | std::ifstream::badbit );
+
+    try {
+        fout.open ( filename, std::ios_base::binary );
     } catch ( std::ifstream::failure &e ) {
         throw ( std::string ( "Error saving file." ) );
     }
@@ -373,29 +1244,18 @@ int Wad::save ( const char *filename )
         this->updateIndexes ();
     }
 
-    unsigned int z = wadlump.size ();
-
     try {
-        fout.write ( reinterpret_cast < char *> ( wad_id.data() ), wad_id.size() );
-        fout.write ( reinterpret_cast < char *> ( &z ), sizeof ( int32_t ) ) ;
-        fout.write ( reinterpret_cast < char *> ( &dirloc ), sizeof ( int32_t ) );
+        writeHeader ( fout );
 
-        for ( it = wadlump.begin (); it != wadlump.end (); ++it ) {
+        for ( unsigned int x = 0; x < names.size(); ++x ) {
             // Write the data
-            fout.seekp ( it->getLocation(), std::ios::beg );
-            if ( it->deduped == false ) {
-                fout.write ( reinterpret_cast < char *> ( it->lumpdata.get() ), it->lumpsize );
+            if ( dedupOf[x] < 0 ) {
+                fout.seekp ( locations[x], std::ios::beg );
+                fout.write ( unpackedData ( x ).get(), sizes[x] );
             }
         }
         // Now write the index
-        fout.seekp ( dirloc, std::ios::beg );
-
-        for ( it = wadlump.begin (); it != wadlump.end (); ++it ) {
-            int32_t loc = it->getLocation();
-            fout.write ( reinterpret_cast < char *> ( &loc ), sizeof ( int32_t ) ) ;
-            fout.write ( reinterpret_cast < char *> ( &it->lumpsize ), sizeof ( int32_t ) );
-            fout.write ( reinterpret_cast < char *> ( &it->name ), lumpNameLength );
-        }
+        writeDirectory ( fout );
     } // End of try
     catch ( std::ifstream::failure &e ) {
         fout.close();
@@ -405,13 +1265,472 @@ int Wad::save ( const char *filename )
     return 0;
 }
 
+void Wad::streamTo ( LumpWriter* lumpWriter )
+{
+    // From now on, lump data is written out by 'lumpWriter' as soon as an entry is stored.
+    writer = lumpWriter;
+}
+
+int Wad::saveStreamed ()
+{
+    // Finishes a save started with streamTo.  The lump data has already been written, so
+    // all that is left is the directory and the header.
+    TRACE_SCOPE ( "save" );
+    std::ofstream &fout = writer->finish();
+
+    numlumps = names.size();
+    dirloc = writer->getOffset();
+
+    try {
+        writeDirectory ( fout );
+        writeHeader ( fout );
+    } catch ( std::ofstream::failure &e ) {
+        fout.close();
+        throw ( std::string ( "Error saving file." ) );
+    }
+    fout.close ();
+    writer = nullptr;
+    sorted = true;
+    return 0;
+}
+
+unsigned int Wad::readNumLumps ( const char* filename )
+{
+    // Reads just the number of lumps from a wad's header, without loading it.
+    std::ifstream fin;
+    int32_t count = 0;
+
+    if ( std::strcmp ( filename, "-" ) == 0 ) {
+        return 0; // Standard input can only be read once, so we don't know until it is loaded.
+    }
+    if ( isDirectory ( filename ) ) {
+        // An extracted wad.  The index has a line for the type, then one for each lump.
+        std::string line;
+        fin.open ( ( std::string ( filename ) + "/" + packIndexName ).c_str() );
+        while ( std::getline ( fin, line ) ) {
+            ++count;
+        }
+        return count > 0 ? count - 1 : 0;
+    }
+
+    fin.exceptions ( std::ifstream::failbit | std::ifstream::badbit );
+
+    try {
+        fin.open ( filename, std::ios_base::binary );
+        fin.seekg ( 4, std::ios::beg );
+        fin.read ( reinterpret_cast<char *> ( &count ), sizeof ( int32_t ) );
+    } catch ( std::istream::failure &e ) {
+        throw ( std::string ( "Error loading file." ) );
+    }
+    return count;
+}
 
 
+
+static std::string escapeName ( const char *name, size_t len, bool forFilename )
+{
+    // Lump names can hold characters which can't go in a filename, or in the index.  Filenames
+    // keep only letters, digits, '_' and '-', and the index anything printable but '%' and space.
+    // The rest is written as %XX.
+    static const char hex[] = "0123456789ABCDEF";
+    std::string out;
+
+    if ( len == 0 ) {
+        return "%00";
+    }
+    for ( size_t x = 0; x < len; ++x ) {
+        unsigned char c = name[x];
+        bool plain = std::isalnum ( c ) || ( c == '_' ) || ( c == '-' );
+
+        if ( !forFilename ) {
+            plain = ( c > ' ' ) && ( c < 0x7f ) && ( c != '%' );
+        }
+        if ( plain ) {
+            out += c;
+        } else {
+            out += '%';
+            out += hex[c >> 4];
+            out += hex[c & 0xf];
+        }
+    }
+    return out;
+}
+
+static int hexDigit ( char c )
+{
+    if ( ( c >= '0' ) && ( c <= '9' ) ) {
+        return c - '0';
+    }
+    if ( ( c >= 'A' ) && ( c <= 'F' ) ) {
+        return c - 'A' + 10;
+    }
+    if ( ( c >= 'a' ) && ( c <= 'f' ) ) {
+        return c - 'a' + 10;
+    }
+    throw ( std::string ( "Error loading file." ) );
+}
+
+static std::string unescapeName ( const std::string &name )
+{
+    // The index may have been edited by hand, so anything which isn't a proper %XX is an error.
+    std::string out;
+
+    for ( size_t x = 0; x < name.size(); ++x ) {
+        if ( name[x] == '%' ) {
+            if ( x + 2 >= name.size() ) {
+                throw ( std::string ( "Error loading file." ) );
+            }
+            out += static_cast<char> ( hexDigit ( name[x + 1] ) * 16 + hexDigit ( name[x + 2] ) );
+            x += 2;
+        } else {
+            out += name[x];
+        }
+    }
+    return out;
+}
+
+static unsigned int fileThreads ( unsigned int count )
+{
+    // Lump files are read and written by several threads at once, so the time is spent
+    // waiting on the disk rather than on each file in turn.
+    unsigned int threads = std::max ( 4u, std::thread::hardware_concurrency() );
+    return std::max ( 1u, std::min ( threads, count ) );
+}
+
+int Wad::extract ( const char* dirname )
+{
+    // Writes each lump to its own file in 'dirname', along with an index giving the wad type and
+    // the order of the lumps, so that the wad can be put back together exactly.  Empty lumps, such
+    // as namespace and map markers, only appear in the index.  Map lumps are named after their map.
+    TRACE_SCOPE_ARG ( "extract", dirname );
+    std::string dir ( dirname );
+    std::vector< std::string > filenames ( names.size() );
+    std::unordered_set< std::string > used;
+    std::string mapname;
+    int mapremaining = 0;
+
+#ifdef _WIN32
+    _mkdir ( dirname );
+#else
+    mkdir ( dirname, 0777 );
+#endif
+    if ( !isDirectory ( dirname ) ) {
+        throw ( std::string ( "Error saving file." ) );
+    }
+
+    for ( unsigned int x = 0; x < names.size(); ++x ) {
+        std::string name = escapeName ( names[x].data(), strnlen ( names[x].data(), lumpNameLength ), true );
+
+        if ( mapremaining > 0 ) {
+            name = mapname + "." + name;
+            --mapremaining;
+        } else if ( ( mapremaining = mapBlockLength ( x ) ) > 0 ) {
+            mapname = name;
+        }
+        if ( sizes[x] == 0 ) {
+            filenames[x] = "-";
+            continue;
+        }
+
+        // Filesystems may not be case sensitive, so compare in lower case.
+        std::string candidate = name;
+        for ( int copy = 1; ; ++copy ) {
+            std::string lower = candidate;
+            std::transform ( lower.begin(), lower.end(), lower.begin(), ::tolower );
+            if ( used.insert ( lower ).second ) {
+                break;
+            }
+            candidate = name + "~" + std::to_string ( copy );
+        }
+        filenames[x] = candidate + ".lmp";
+    }
+
+    std::vector< std::thread > workers;
+    std::atomic< bool > failed ( false );
+    unsigned int threads = fileThreads ( names.size() );
+
+    for ( unsigned int t = 0; t < threads; ++t ) {
+        workers.push_back ( std::thread ( [&, t] () {
+            TRACE_SCOPE ( "write lump files" );
+            for ( unsigned int x = t; x < names.size(); x += threads ) {
+                if ( sizes[x] > 0 ) {
+                    std::ofstream fout ( ( dir + "/" + filenames[x] ).c_str(), std::ios_base::binary );
+                    try {
+                        fout.write ( unpackedData ( x ).get(), sizes[x] );
+                    } catch ( std::string &err ) {
+                        failed = true;
+                    }
+                    if ( !fout ) {
+                        failed = true;
+                    }
+                }
+            }
+        } ) );
+    }
+    for ( std::vector< std::thread >::iterator it = workers.begin(); it != workers.end(); ++it ) {
+        it->join();
+    }
+
+    std::ofstream index ( ( dir + "/" + packIndexName ).c_str() );
+    index << std::string ( wad_id.begin(), wad_id.end() ) << "\n";
+    for ( unsigned int x = 0; x < names.size(); ++x ) {
+        index << escapeName ( names[x].data(), strnlen ( names[x].data(), lumpNameLength ), false ) << " " << filenames[x] << "\n";
+    }
+    index.close();
+
+    if ( failed || !index ) {
+        throw ( std::string ( "Error saving file." ) );
+    }
+    updateIndexes(); // So the statistics are right.
+    return 0;
+}
+
+int Wad::loadDirectory ( const char* dirname )
+{
+    // Puts back together a wad written by extract().
+    TRACE_SCOPE_ARG ( "load directory", dirname );
+    std::string dir ( dirname );
+    std::ifstream index ( ( dir + "/" + packIndexName ).c_str() );
+    std::vector< std::string > filenames;
+    std::string line, id, name, file, extra;
+    bool haveId = false;
+
+    if ( !index ) {
+        throw ( std::string ( "Error loading file." ) );
+    }
+
+    // The first line is the wad type, and every line after it a lump name and its file.  Blank
+    // lines are skipped, but anything else which doesn't fit is an error.
+    while ( std::getline ( index, line ) ) {
+        std::istringstream fields ( line );
+
+        if ( !haveId ) {
+            if ( !( fields >> id ) ) {
+                continue;
+            }
+            if ( ( id.size() != wad_id.size() ) || ( fields >> extra ) ) {
+                throw ( std::string ( "Error loading file." ) );
+            }
+            std::copy ( id.begin(), id.end(), wad_id.begin() );
+            haveId = true;
+            continue;
+        }
+        if ( !( fields >> name ) ) {
+            continue;
+        }
+        if ( !( fields >> file ) || ( fields >> extra ) ) {
+            throw ( std::string ( "Error loading file." ) );
+        }
+
+        // Lump files have to be in the directory itself.
+        if ( ( file.find_first_of ( "/\\" ) != std::string::npos ) || ( file.find ( ".." ) != std::string::npos ) ) {
+            throw ( std::string ( "Error loading file." ) );
+        }
+
+        std::array<char, 8> lumpname;
+        std::string unescaped = unescapeName ( name );
+
+        if ( unescaped.size() > static_cast<size_t> ( lumpNameLength ) ) {
+            throw ( std::string ( "Error loading file." ) );
+        }
+        lumpname.fill ( 0 );
+        std::copy ( unescaped.begin(), unescaped.end(), lumpname.begin() );
+        names.push_back ( lumpname );
+        types.push_back ( getCurrentType ( lumpname ) );
+        filenames.push_back ( file );
+    }
+    if ( !haveId ) {
+        throw ( std::string ( "Error loading file." ) );
+    }
+
+    numlumps = names.size();
+    sizes.assign ( numlumps, 0 );
+    locations.assign ( numlumps, 0 );
+    fingerprints.assign ( numlumps, fingerprint ( nullptr, 0 ) );
+    dedupOf.assign ( numlumps, -1 );
+    packedSizes.assign ( numlumps, 0 );
+    lumpdata.assign ( numlumps, std::shared_ptr<char>() );
+
+    std::vector< std::thread > workers;
+    std::atomic< bool > failed ( false );
+    unsigned int threads = fileThreads ( numlumps );
+
+    for ( unsigned int t = 0; t < threads; ++t ) {
+        workers.push_back ( std::thread ( [&, t] () {
+            TRACE_SCOPE ( "read lump files" );
+            for ( unsigned int x = t; x < numlumps; x += threads ) {
+                if ( filenames[x] == "-" ) {
+                    lumpdata[x] = make_shared_array<char> ( 0 );
+                    continue;
+                }
+                std::ifstream fin ( ( dir + "/" + filenames[x] ).c_str(), std::ios_base::binary | std::ios_base::ate );
+                std::streamoff size = fin.tellg();
+
+                if ( !fin || ( size < 0 ) ) {
+                    failed = true;
+                    continue;
+                }
+                sizes[x] = size;
+                lumpdata[x] = make_shared_array<char> ( size );
+                fin.seekg ( 0, std::ios::beg );
+                fin.read ( lumpdata[x].get(), size );
+                if ( !fin ) {
+                    failed = true;
+                }
+                fingerprints[x] = fingerprint ( lumpdata[x].get(), sizes[x] );
+            }
+        } ) );
+    }
+    for ( std::vector< std::thread >::iterator it = workers.begin(); it != workers.end(); ++it ) {
+        it->join();
+    }
+
+    if ( failed ) {
+        throw ( std::string ( "Error reading file." ) );
+    }
+
+    this->calcLabelOffsets();
+    this->calcMapFingerprints();
+    this->updateIndexes();
+    sorted = true;
+    this->determineWadGameType();
+    return 0;
+}
+
+void Wad::parseDirectory ( const char* directory )
+{
+    // Fills in the directory from its 'numlumps' entries as they are in the wad.
+    TRACE_SCOPE ( "directory parse" );
+
+    names.resize ( numlumps );
+    sizes.resize ( numlumps );
+    locations.resize ( numlumps );
+    types.resize ( numlumps );
+    fingerprints.resize ( numlumps );
+    dedupOf.assign ( numlumps, -1 );
+    packedSizes.assign ( numlumps, 0 );
+    lumpdata.resize ( numlumps );
+
+    for ( unsigned int count = 0; count < numlumps; ++count ) {
+        int32_t x;
+        std::memcpy ( &x, directory, sizeof ( int32_t ) );
+        locations[count] = x;
+        std::memcpy ( &x, directory + sizeof ( int32_t ), sizeof ( int32_t ) );
+        sizes[count] = x;
+        std::memcpy ( names[count].data(), directory + sizeof ( int32_t ) * 2, lumpNameLength );
+        types[count] = this->getCurrentType ( names[count] );
+        directory += sizeof ( int32_t ) * 2 + lumpNameLength;
+
+        if ( ( sizes[count] < 0 ) || ( locations[count] < 0 ) ) {
+            throw ( std::string ( "Error reading file." ) );
+        }
+    }
+}
+
+void Wad::viewLumps ( const std::shared_ptr<char>& block, const std::vector<int>& offsets )
+{
+    // Points each lump at its data, at 'offsets' in 'block'.  The lumps share the block's
+    // reference count, so it is freed once nothing uses any lump from this wad.
+    TRACE_SCOPE ( "fingerprint" );
+
+    for ( unsigned int count = 0; count < numlumps; ++count ) {
+        char *data = block.get() + offsets[count];
+        lumpdata[count] = std::shared_ptr<char> ( block, data );
+        fingerprints[count] = fingerprint ( data, sizes[count] );
+    }
+
+    this->calcLabelOffsets();  // Calculate where the end group tags are.
+    this->calcMapFingerprints();
+    sorted = true;
+    this->wadType();  // This fetches the WAD type (PWAD/IWAD), but also sets
+    // the 'iwad' flag to true or false.  Call this to set the flag to the correct value.
+    this->determineWadGameType();
+}
+
+int Wad::loadBuffer ( const std::shared_ptr<char>& buffer, size_t size )
+{
+    // Loads a wad which is already in memory.  Nothing is copied; the lumps point into 'buffer'.
+    TRACE_SCOPE ( "load buffer" );
+    const char *data = buffer.get();
+    int32_t count;
+
+    if ( size < static_cast<size_t> ( wadLumpBeginOffset ) ) {
+        throw ( std::string ( "Error reading file." ) );
+    }
+    std::memcpy ( wad_id.data(), data, wad_id.size() );
+    std::memcpy ( &count, data + wad_id.size(), sizeof ( int32_t ) );
+    std::memcpy ( &dirloc, data + wad_id.size() + sizeof ( int32_t ), sizeof ( int32_t ) );
+
+    if ( ( count < 0 ) || ( dirloc < 0 ) || ( static_cast<uint64_t> ( dirloc ) + static_cast<uint64_t> ( count ) * ( sizeof ( int32_t ) * 2 + lumpNameLength ) > size ) ) {
+        throw ( std::string ( "Error reading file." ) );
+    }
+    numlumps = count;
+    parseDirectory ( data + dirloc );
+
+    for ( unsigned int x = 0; x < numlumps; ++x ) {
+        if ( static_cast<uint64_t> ( locations[x] ) + sizes[x] > size ) {
+            throw ( std::string ( "Error reading file." ) );
+        }
+    }
+    viewLumps ( buffer, locations );
+    return 0;
+}
+
+static std::shared_ptr<char> readStandardInput ( size_t& size )
+{
+    // Standard input can't seek, so all of it is read into one buffer.  If it is a file, we know
+    // how big it is.  Otherwise it is read into a buffer which grows as needed, then copied into
+    // one of exactly the right size, so the spare space isn't held for the rest of the run.
+    TRACE_SCOPE ( "read standard input" );
+    struct stat info;
+    size_t count;
+
+#ifdef _WIN32
+    _setmode ( _fileno ( stdin ), _O_BINARY );
+#endif
+    if ( ( fstat ( fileno ( stdin ), &info ) == 0 ) && ( ( info.st_mode & S_IFMT ) == S_IFREG ) ) {
+        long start = ftell ( stdin );
+        size_t expected = info.st_size - ( start > 0 ? start : 0 );
+        std::shared_ptr<char> buffer = make_shared_array<char> ( expected );
+
+        size = fread ( buffer.get(), 1, expected, stdin );
+        if ( ferror ( stdin ) ) {
+            throw ( std::string ( "Error reading file." ) );
+        }
+        return buffer;
+    }
+
+    std::vector<char> growing ( 1 << 20 );
+    size = 0;
+    while ( ( count = fread ( growing.data() + size, 1, growing.size() - size, stdin ) ) > 0 ) {
+        size += count;
+        if ( size == growing.size() ) {
+            growing.resize ( growing.size() * 2 );
+        }
+    }
+    if ( ferror ( stdin ) ) {
+        throw ( std::string ( "Error reading file." ) );
+    }
+
+    std::shared_ptr<char> buffer = make_shared_array<char> ( size );
+    std::memcpy ( buffer.get(), growing.data(), size );
+    return buffer;
+}
+
 int Wad::load ( const char* filename )
 {
+    if ( std::strcmp ( filename, "-" ) == 0 ) {
+        size_t size;
+        std::shared_ptr<char> buffer = readStandardInput ( size );
+        return loadBuffer ( buffer, size );
+    }
+    if ( isDirectory ( filename ) ) {
+        return loadDirectory ( filename );
+    }
+
+    TRACE_SCOPE_ARG ( "load", filename );
     std::ifstream fin;
     fin.exceptions ( std::ifstream::failbit | std::ifstream::badbit );
-    Wadlumpdata wadindex;
 
     try {
         fin.open ( filename, std::ios_base::binary );
@@ -423,44 +1742,87 @@ int Wad::load ( const char* filename )
         fin.read ( reinterpret_cast<char *> ( wad_id.data() ), wad_id.size() );
         fin.read ( reinterpret_cast<char *> ( &numlumps ), sizeof ( int32_t ) );
         fin.read ( reinterpret_cast<char *> ( &dirloc ), sizeof ( int32_t ) );
+        fin.seekg ( 0, std::ios::end );
+        int64_t filesize = fin.tellg();
         fin.seekg ( dirloc, std::ios::beg );
 
-        wadlump.reserve ( numlumps );
+        std::vector<char> directory ( static_cast<size_t> ( numlumps ) * ( sizeof ( int32_t ) * 2 + lumpNameLength ) );
+        fin.read ( directory.data(), directory.size() );
+        parseDirectory ( directory.data() );
 
-        for ( int count = 0; count < numlumps; ++count ) {
-            // We read the lump information.
-            int32_t x;
-            fin.read ( reinterpret_cast<char *> ( &x ), sizeof ( int32_t ) );
-            wadindex.setLocation( x );
-            fin.read ( reinterpret_cast<char *> ( &wadindex.lumpsize ), sizeof ( int32_t ) );
-            fin.read ( reinterpret_cast<char *> ( &wadindex.name ), lumpNameLength );
-            wadindex.deduped = false;
-            wadindex.type = this->getCurrentType ( wadindex );
-            wadlump.push_back ( std::move ( wadindex ) );
+        for ( unsigned int x = 0; x < numlumps; ++x ) {
+            if ( static_cast<int64_t> ( locations[x] ) + sizes[x] > filesize ) {
+                throw ( std::string ( "Error reading file." ) );
+            }
+        }
+
+        // Now we will read the lump data.  All of it goes into one block (the arena), and each lump
+        // points into it.
+        //
+        // The directory needn't be in the same order as the data, so the lumps are sorted by where
+        // they are in the file, and those which are next to or overlap each other are read together.
+        // Only large gaps, such as unused space left by a wad editor, are skipped.  A lump ends
+        // within the file, but may end past 2 GiB.  It can't start there, so its place in the arena
+        // (which is no further on than its place in the file) still fits in an int.
+        std::vector<int> order;
+        std::vector< std::pair<int64_t, int64_t> > ranges; // Start and end in the file.
+        std::vector<int> arenapos ( numlumps, 0 );
+        int64_t arenasize = 0;
+
+        for ( unsigned int count = 0; count < numlumps; ++count ) {
+            if ( sizes[count] > 0 ) {
+                order.push_back ( count );
+            }
+        }
+        std::sort ( order.begin(), order.end(), [this] ( int a, int b ) {
+            return locations[a] < locations[b];
+        } );
+
+        for ( std::vector<int>::const_iterator it = order.begin(); it != order.end(); ++it ) {
+            int64_t start = locations[*it];
+            int64_t end = start + sizes[*it];
+
+            if ( ranges.empty() || ( start > ranges.back().second + readGapLimit ) ) {
+                ranges.push_back ( std::make_pair ( start, end ) );
+                arenasize += end - start;
+            } else if ( end > ranges.back().second ) {
+                arenasize += end - ranges.back().second;
+                ranges.back().second = end;
+            }
+            arenapos[*it] = static_cast<int> ( arenasize - ( ranges.back().second - start ) );
         }
 
-        // Now we will read the lump data.
-        for ( std::vector < Wadlumpdata >::iterator it = wadlump.begin(); it != wadlump.end(); ++it ) {
-            fin.seekg ( it->getLocation(), std::ios::beg );
-            //it->lumpdata.assign ( new unsigned char[it->lumpsize] );
-            it->lumpdata = make_shared_array<char> ( it->lumpsize );
-            //  = std::make_shared<char *>(new char[it->lumpsize])
-            fin.read ( reinterpret_cast<char *> ( it->lumpdata.get() ), it->lumpsize );
+#ifdef __linux__
+        // Let the kernel start fetching every range now, rather than as each is reached.
+        int fd = open ( filename, O_RDONLY );
+        if ( fd >= 0 ) {
+            for ( std::vector< std::pair<int64_t, int64_t> >::const_iterator r = ranges.begin(); r != ranges.end(); ++r ) {
+                posix_fadvise ( fd, r->first, r->second - r->first, POSIX_FADV_WILLNEED );
+            }
+            close ( fd );
+        }
+#endif
+
+        std::shared_ptr<char> arena = make_shared_array<char> ( arenasize );
+        {
+            TRACE_SCOPE ( "read lump data" );
+            char *dest = arena.get();
+            for ( std::vector< std::pair<int64_t, int64_t> >::const_iterator r = ranges.begin(); r != ranges.end(); ++r ) {
+                fin.seekg ( r->first, std::ios::beg );
+                fin.read ( dest, r->second - r->first );
+                dest += r->second - r->first;
+            }
         }
 
+        viewLumps ( arena, arenapos );
+
     } // End of try block
     catch ( std::istream::failure &e ) {
         fin.close();
         throw ( std::string ( "Error reading file." ) );
     }
 
-    this->calcLabelOffsets();  // Calculate where the end group tags are.
-    sorted = true;
-    this->wadType();  // This fetches the WAD type (PWAD/IWAD), but also sets
-    // the 'iwad' flag to true or false.  Call this to set the flag to the correct value.
-
     fin.close();
-    this->determineWadGameType();
     return 0;
 }
 
@@ -470,9 +1832,11 @@ int Wad::calcLabelOffsets ()
     lumpTypes currType = T_GENERAL;
     int count = 0;
 
-    for ( std::vector < Wadlumpdata >::const_iterator it = wadlump.begin (); it != wadlump.end (); ++it ) {
+    std::fill ( groupEndOffsets.begin(), groupEndOffsets.end(), 0 );
+
+    for ( std::vector < lumpTypes >::const_iterator it = types.begin (); it != types.end (); ++it ) {
         currType = thisType;
-        thisType = it->type;
+        thisType = *it;
 
         if ( ( thisType == T_GENERAL ) && ( currType != T_GENERAL ) ) {
             if ( ( currType == T_F1_START ) || ( currType == T_F2_START )
@@ -489,41 +1853,41 @@ int Wad::calcLabelOffsets ()
 }
 
 
-lumpTypes Wad::getCurrentType ( const Wadlumpdata & entry )
+lumpTypes Wad::getCurrentType ( const std::array<char, 8> &name )
 {
     static lumpTypes currenttype = T_GENERAL;
 
-    if ( std::equal ( entry.name.begin(), entry.name.begin() + 7, "F_START" ) ) {
+    if ( std::equal ( name.begin(), name.begin() + 7, "F_START" ) ) {
         currenttype = T_F_START;
-    } else if ( std::equal ( entry.name.begin(), entry.name.begin() + 8, "F1_START" ) ) {
+    } else if ( std::equal ( name.begin(), name.begin() + 8, "F1_START" ) ) {
         currenttype = T_F1_START;
-    } else if ( std::equal ( entry.name.begin(), entry.name.begin() + 8, "F2_START" ) ) {
+    } else if ( std::equal ( name.begin(), name.begin() + 8, "F2_START" ) ) {
         currenttype = T_F2_START;
-    } else if ( std::equal ( entry.name.begin(), entry.name.begin() + 8, "F3_START" ) ) {
+    } else if ( std::equal ( name.begin(), name.begin() + 8, "F3_START" ) ) {
         currenttype = T_F3_START;
-    } else if ( std::equal ( entry.name.begin(), entry.name.begin() + 7, "S_START" ) ) {
+    } else if ( std::equal ( name.begin(), name.begin() + 7, "S_START" ) ) {
         currenttype = T_S_START;
-    } else if ( std::equal ( entry.name.begin(), entry.name.begin() + 7, "P_START" ) ) {
+    } else if ( std::equal ( name.begin(), name.begin() + 7, "P_START" ) ) {
         currenttype = T_P_START;
-    } else if ( std::equal ( entry.name.begin(), entry.name.begin() + 8, "P1_START" ) ) {
+    } else if ( std::equal ( name.begin(), name.begin() + 8, "P1_START" ) ) {
         currenttype = T_P1_START;
-    } else if ( std::equal ( entry.name.begin(), entry.name.begin() + 8, "P2_START" ) ) {
+    } else if ( std::equal ( name.begin(), name.begin() + 8, "P2_START" ) ) {
         currenttype = T_P2_START;
-    } else if ( std::equal ( entry.name.begin(), entry.name.begin() + 7, "C_START" ) ) {
+    } else if ( std::equal ( name.begin(), name.begin() + 7, "C_START" ) ) {
         currenttype = T_C_START;
-    } else if ( std::equal ( entry.name.begin(), entry.name.begin() + 5, "F_END" ) ) {
+    } else if ( std::equal ( name.begin(), name.begin() + 5, "F_END" ) ) {
         currenttype = T_GENERAL;
-    } else if ( std::equal ( entry.name.begin(), entry.name.begin() + 6, "F1_END" ) ) {
+    } else if ( std::equal ( name.begin(), name.begin() + 6, "F1_END" ) ) {
         currenttype = T_GENERAL;
-    } else if ( std::equal ( entry.name.begin(), entry.name.begin() + 6, "F2_END" ) ) {
+    } else if ( std::equal ( name.begin(), name.begin() + 6, "F2_END" ) ) {
         currenttype = T_GENERAL;
-    } else if ( std::equal ( entry.name.begin(), entry.name.begin() + 5, "S_END" ) ) {
+    } else if ( std::equal ( name.begin(), name.begin() + 5, "S_END" ) ) {
         currenttype = T_GENERAL;
-    } else if ( std::equal ( entry.name.begin(), entry.name.begin() + 5, "P_END" ) ) {
+    } else if ( std::equal ( name.begin(), name.begin() + 5, "P_END" ) ) {
         currenttype = T_GENERAL;
-    } else if ( std::equal ( entry.name.begin(), entry.name.begin() + 6, "P1_END" ) ) {
+    } else if ( std::equal ( name.begin(), name.begin() + 6, "P1_END" ) ) {
         currenttype = T_GENERAL;
-    } else if ( std::equal ( entry.name.begin(), entry.name.begin() + 6, "P2_END" ) ) {
+    } else if ( std::equal ( name.begin(), name.begin() + 6, "P2_END" ) ) {
         currenttype = T_GENERAL;
     }
 
@@ -563,6 +1927,17 @@ void Wad::setHashSize ( int hashsz )
     hashsize = hashsz;
 }
 
+void Wad::setClusterLayout ( bool cluster )
+{
+    clusterLayout = cluster;
+    sorted = false;
+}
+
+void Wad::setLastWins ( bool last )
+{
+    lastWins = last;
+}
+
 void Wad::stats ( void ) const
 {
     // outputs some statistics.  Only really useful for the output wad.
@@ -576,29 +1951,125 @@ void Wad::stats ( void ) const
         std::cout << "Entries deduplicated : " << numDeduplicated << std::endl;
     }
 
+    if ( numReplaced ) {
+        std::cout << "Entries replaced by later ones : " << numReplaced << std::endl;
+    }
+
+    if ( numDeltaRemoved ) {
+        std::cout << "Entries already in base wad : " << numDeltaRemoved << std::endl;
+    }
+
+    int packed = 0;
+    int unpacked = 0;
+    for ( unsigned int x = 0; x < packedSizes.size(); ++x ) {
+        if ( packedSizes[x] && ( dedupOf[x] < 0 ) ) {
+            packed += packedSizes[x];
+            unpacked += sizes[x];
+        }
+    }
+    if ( packed ) {
+        std::cout << "Lump data kept compressed in memory : " << unpacked << " bytes in " << packed << std::endl;
+    }
+
+    if ( clusterLayout ) {
+        TRACE_SCOPE ( "estimate compressed size" );
+        std::vector<int> inserted;
+        for ( unsigned int x = 0; x < names.size(); ++x ) {
+            if ( dedupOf[x] < 0 ) {
+                inserted.push_back ( x );
+            }
+        }
+        int64_t before = packedEstimate ( inserted );
+        int64_t after = packedEstimate ( clusterOrder() );
+        std::cout << "Estimated compressed lump data : " << after << " bytes, from " << before << " in directory order";
+        if ( before > 0 ) {
+            std::cout << " (" << std::showpos << ( ( after - before ) * 1000 / before ) / 10.0 << std::noshowpos << "%)";
+        }
+        std::cout << std::endl;
+    }
+
+    if ( numMapsShared ) {
+        std::cout << "Maps sharing data with an identical map : " << numMapsShared << std::endl;
+    }
+
+    if ( !mapConflicts.empty() ) {
+        std::cout << "Maps dropped which differ from the one kept :";
+        for ( std::vector< std::string >::const_iterator it = mapConflicts.begin(); it != mapConflicts.end(); ++it ) {
+            std::cout << " " << *it;
+        }
+        std::cout << std::endl;
+    }
+
     std::cout << "Output WAD file size " << dirloc + ( numlumps * ( lumpNameLength + ( sizeof ( uint32_t ) * 2 ) ) ) << " bytes" << std::endl;
 }
 
 
-Wadlumpdata::Wadlumpdata() : ptr( nullptr )
+std::shared_ptr< const WadSnapshot > Wad::snapshot()
+{
+    // Lays the wad out first, so the locations in the snapshot are the ones it would be saved with.
+    std::shared_ptr< WadSnapshot > frozen ( new WadSnapshot() );
+
+    if ( sorted == false ) {
+        this->updateIndexes();
+    }
+
+    frozen->entries.reserve ( names.size() );
+    for ( unsigned int x = 0; x < names.size(); ++x ) {
+        frozen->entries.push_back ( getEntry ( x ) );
+        frozen->entries.back().lumpdata = unpackedData ( x ); // Expanded now, so that reading it needs nothing more.
+        frozen->entries.back().packedsize = 0;
+        frozen->nameIndex.insert ( std::make_pair ( lumpName ( names[x] ), x ) );
+    }
+    frozen->type = wadType();
+    frozen->gameType = wadGameType;
+    return frozen;
+}
+
+WadSnapshot::WadSnapshot() : type ( WAD_PWAD ), gameType ( G_UNKNOWN )
 {
 }
 
-int Wadlumpdata::getLocation()
+unsigned int WadSnapshot::getNumLumps ( void ) const
 {
-  if (ptr == nullptr) {
-    return location;
-  } else if ( deduped == true ) {
-    return ptr->getLocation();
-  } else throw ( std::string ( "Non deduplicated entry with pointer to another entry...\n" ) );
+    return entries.size();
 }
 
-void Wadlumpdata::setLocation(int loc)
+const Wadlumpdata& WadSnapshot::operator[] ( int entrynum ) const
 {
-  location = loc;
+    return entries.at ( entrynum );
 }
 
-void Wadlumpdata::setLocation(Wadlumpdata* p)
+int WadSnapshot::find ( const std::string& name ) const
 {
-  ptr = p;
+    std::unordered_map< std::string, int >::const_iterator found = nameIndex.find ( name );
+    return ( found == nameIndex.end() ) ? -1 : found->second;
+}
+
+const char* WadSnapshot::data ( int entrynum ) const
+{
+    return entries.at ( entrynum ).lumpdata.get();
+}
+
+wadTypes WadSnapshot::wadType() const
+{
+    return type;
+}
+
+gameTypes WadSnapshot::getGameType() const
+{
+    return gameType;
+}
+
+Wadlumpdata::Wadlumpdata() : type ( T_GENERAL ), lumpsize ( 0 ), fingerprint ( 0 ), packedsize ( 0 ), deduped ( false ), location ( 0 )
+{
+}
+
+int Wadlumpdata::getLocation() const
+{
+  return location;
+}
+
+void Wadlumpdata::setLocation(int loc)
+{
+  location = loc;
 }
@@ -23,6 +23,9 @@
 #include <algorithm>
 #include <memory>
 #include <array>
+#include <iosfwd>
+#include <unordered_map>
+#include <stdint.h>
 //#include <cstdalign>
 
 #ifndef WAD_H
@@ -35,14 +38,24 @@ std::shared_ptr<T> make_shared_array ( size_t size )
 }
 
 
-unsigned long hash ( char *str );
+class LumpWriter;
+class WadSnapshot;
+
+unsigned long hash ( const char *str );
+uint64_t fingerprint ( const char *data, int size );
 int findHigherPrime ( int start );
 
 enum flags {
     F_ALLOW_DUPLICATES 	= 0x1,
     F_DEDUP		= 0x2,
     F_IWAD		= 0x4,
-    F_PWAD		= 0x8
+    F_PWAD		= 0x8,
+    F_LAST_WINS		= 0x10,
+    F_PIPELINE		= 0x20,
+    F_WATCH		= 0x40,
+    F_EXTRACT		= 0x80,
+    F_COMPRESS		= 0x100,
+    F_CLUSTER		= 0x200
 };
 
 typedef enum enum_wadtypes {
@@ -76,22 +89,22 @@ typedef enum enum_gametypes {
 // That reason is, so that we can use the gameTypes value to advances the right number of lump entries
 // to get the next map.
 
+// A single lump, as passed in and out of a Wad.  Inside a Wad the directory is
+// stored as parallel arrays instead, see below.
 class Wadlumpdata {
   public:
     Wadlumpdata();
     lumpTypes type;  // This is not written to the wad.
-    int getLocation();
+    int getLocation() const;
     void setLocation( int loc );
-    void setLocation( Wadlumpdata *p );
     int lumpsize;
     std::array<char, 8> name;
     std::shared_ptr<char> lumpdata;
+    uint64_t fingerprint; // Hash of lumpdata, calculated once when loaded.
+    int packedsize; // If not zero, lumpdata is compressed and this is its length.
     bool deduped; // Neither is this.
   private:
     int location;
-    Wadlumpdata *ptr; // Pointer to original data, if deduplicated.
-
-  
 };
 
 
@@ -109,38 +122,119 @@ private:
     int duplicatesFound; // Defaults to zero, increments each time a lump
     // was added which is a duplicate of a previous one.
     int numDeduplicated;
+    int numDeltaRemoved; // Lumps dropped because the base wad already has them.
+    int numReplaced; // Lumps overwritten by a later one of the same name.
+    int numMapsShared; // Maps which share all their data with an identical one.
+    bool lastWins; // Later duplicates replace earlier ones, instead of being dropped.
+    bool clusterLayout; // Lay out the lump data grouped by kind, rather than in directory order.
+    std::unordered_map< std::string, int > lumpIndex; // Lump name to position.  Only kept up to date with lastWins.
+    LumpWriter *writer; // If set, lump data is written out as soon as it is stored.
     gameTypes wadGameType;
 
     std::vector< int > hasher;
     bool hasherInitialised;
-    std::vector< Wadlumpdata > wadlump;
+
+    // The directory, one element per lump in each.  Kept as separate arrays so that
+    // scans over the directory only have to go through the fields they look at.
+    std::vector< std::array<char, 8> > names;
+    std::vector< int > sizes;
+    std::vector< int > locations;
+    std::vector< lumpTypes > types;
+    std::vector< uint64_t > fingerprints;
+    std::vector< int > dedupOf; // Entry whose data this one shares, or -1.
+    std::vector< int > packedSizes; // Length of the compressed data, or 0 if not compressed.
+    std::vector< std::shared_ptr<char> > lumpdata;
+
+    std::unordered_map< int, uint64_t > mapFingerprints; // Map marker position to mapFingerprint(), calculated on load.
+    std::unordered_map< std::string, uint64_t > mergedMaps; // Name and fingerprint of each map merged in.
+    std::vector< std::string > mapConflicts; // Maps dropped as duplicates, but which differ from the one kept.
+
     gameTypes determineWadGameType();
 
     int updateIndexes();
     int calcLabelOffsets();
-    lumpTypes getCurrentType ( const Wadlumpdata &entry );
+    lumpTypes getCurrentType ( const std::array<char, 8> &name );
+    Wadlumpdata getEntry ( int index ) const;
+    void setEntry ( int index, const Wadlumpdata& entry );
+    void insertEntry ( int index, const Wadlumpdata& entry );
+    void eraseEntries ( int index, int count );
+    int mapBlockLength ( int index ) const;
+    uint64_t mapFingerprint ( int index ) const;
+    void calcMapFingerprints();
+    void noteMap ( const Wad& wad, int source, bool stored );
+    bool sameMapData ( int first, int second, int length ) const;
+    bool sameData ( int first, int second ) const;
+    void parseDirectory ( const char* directory );
+    void viewLumps ( const std::shared_ptr<char>& block, const std::vector<int>& offsets );
+    std::vector<int> clusterOrder() const;
+    int64_t packedEstimate ( const std::vector<int>& order ) const;
+    std::shared_ptr<char> unpackedData ( int index ) const;
+    void shiftLumpIndex ( int from, int amount );
+    void replaceMap ( int index, const Wad& wad, int source );
+    void placeEntry ( const Wadlumpdata& entry, bool ismap );
+    int duplicateSpan ( int x, int& discarded ) const;
+    void writeHeader ( std::ostream& fout );
+    void writeDirectory ( std::ostream& fout );
+    Wad ( const Wad& obj ); // Use clone() to copy a Wad.
 
 public:
-    //Wad& operator=(const Wad& obj);
-    Wad ( const Wad& obj );
-    Wad ( Wad&& obj );
+    Wad& operator= ( const Wad& obj ) = delete;
+    Wad& operator= ( Wad&& obj ) noexcept;
+    Wad ( Wad&& obj ) noexcept;
+    Wad clone() const;
     Wad();
-    Wad ( const char* filename );
+    Wad ( const char* filename ); // "-" reads the wad from standard input.
+    Wad ( const std::shared_ptr<char>& buffer, size_t size );
     ~Wad();
     int deduplicate();
-    Wadlumpdata& operator[] ( int entrynum );
+    void compress();
+    int deltaAgainst ( const Wad& base );
+    Wadlumpdata operator[] ( int entrynum );
     int save ( const char* filename );
     int load ( const char* filename );
+    int loadDirectory ( const char* dirname );
+    int loadBuffer ( const std::shared_ptr<char>& buffer, size_t size );
+    int extract ( const char* dirname );
+    void streamTo ( LumpWriter* lumpWriter );
+    int saveStreamed ();
+    static unsigned int readNumLumps ( const char* filename );
     bool storeEntry ( const Wadlumpdata& entry, bool allowDuplicates ); // Returns "true" if the entry was a duplicate.
     unsigned int getNumLumps ( void ) const;
     void stats ( void ) const;
     int mergeWad ( Wad& wad, bool allowDuplicates );
+    int mergeWads ( std::vector< Wad >& wads, bool allowDuplicates, unsigned int threads );
     wadTypes wadType();
     void setHashSize ( int hashsz );
+    void setLastWins ( bool last );
+    void setClusterLayout ( bool cluster );
     wadTypes wadType ( wadTypes type );
     gameTypes getGameType();
+    std::shared_ptr< const WadSnapshot > snapshot();
 
 };
 
+// A frozen, read only copy of a Wad's directory, made by Wad::snapshot().  Nothing in it
+// changes once made, so any number of threads can use one at the same time without locking.
+// The lump data is shared with the Wad it came from, which never changes data in place.
+class WadSnapshot
+{
+private:
+    friend class Wad;
+    WadSnapshot();
+
+    std::vector< Wadlumpdata > entries;
+    std::unordered_map< std::string, int > nameIndex; // Lump name to its first entry.
+    wadTypes type;
+    gameTypes gameType;
+
+public:
+    unsigned int getNumLumps ( void ) const;
+    const Wadlumpdata& operator[] ( int entrynum ) const;
+    int find ( const std::string& name ) const; // Returns -1 if there is no such lump.
+    const char* data ( int entrynum ) const;
+    wadTypes wadType() const;
+    gameTypes getGameType() const;
+};
+
 #endif // WAD_H
 